@@ -5,6 +5,26 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <signal.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "simplify.h"
+#include "trace.h"
 
 #define MIDI_HEADER "MThd"
 #define MIDI_TRACK "MTrk"
@@ -50,6 +70,76 @@ typedef struct {
     char* note;
 } MidiNote;
 
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// Big reusable output buffer flushed with plain write() calls.
+typedef struct {
+    int fd;
+    char* buf;
+    size_t len;
+    int failed;
+} OutBuf;
+
+// What to do with notes outside the piano's 61 keys.
+enum {
+    FOLD_WRAP,       // move by octaves until they fit
+    FOLD_CLAMP,      // play the nearest end key
+    FOLD_DROP,       // leave them out
+    FOLD_TRANSPOSE   // shift the whole song by octaves to fit the most notes, wrap the rest
+};
+
+// Number lists like "1,3-5,10" for --tracks, --channels and --keys. An empty
+// list lets everything through.
+#define MAX_FILTER_RANGES 16
+
+typedef struct {
+    int count;
+    int lo[MAX_FILTER_RANGES];
+    int hi[MAX_FILTER_RANGES];
+} RangeList;
+
+int range_list_parse(RangeList* list, const char* spec) {
+    list->count = 0;
+    
+    while (*spec) {
+        char* end;
+        long lo = strtol(spec, &end, 10);
+        long hi = lo;
+        if (end == spec || lo < 0) return 0;
+        
+        if (*end == '-') {
+            spec = end + 1;
+            hi = strtol(spec, &end, 10);
+            if (end == spec || hi < lo) return 0;
+        }
+        if (list->count == MAX_FILTER_RANGES || (*end && *end != ',')) return 0;
+        
+        list->lo[list->count] = (int)lo;
+        list->hi[list->count] = (int)(hi > INT_MAX ? INT_MAX : hi);
+        list->count++;
+        spec = *end ? end + 1 : end;
+    }
+    return list->count > 0;
+}
+
+int range_list_has(const RangeList* list, int value) {
+    if (list->count == 0) return 1;
+    
+    for (int i = 0; i < list->count; i++) {
+        if (value >= list->lo[i] && value <= list->hi[i]) return 1;
+    }
+    return 0;
+}
+
+// Which parts of the file get converted. Excluded tracks are skipped whole by
+// their MTrk length, excluded channels are dropped at the status byte, and
+// excluded keys are left out of key_map.
+typedef struct {
+    RangeList tracks;       // 1-based, in file order
+    uint16_t channels;      // bit n = channel n + 1
+    RangeList keys;         // MIDI note numbers
+} MidiFilter;
+
 typedef struct {
     int verbose;
     int debug;
@@ -67,6 +157,7 @@ typedef struct {
     
     uint8_t* bytes;
     size_t bytes_size;
+    size_t limit;               // reads stop here: the end of the current chunk, or of the file
     
     char* filename;
     char* record_file;
@@ -78,12 +169,43 @@ typedef struct {
     
     char piano_scale[64];
     
+    int fold;
+    int transpose;              // octaves, picked by choose_transpose()
+    char key_map[256];          // data byte -> piano key, 0 = not played
+    uint32_t dropped_keys;
+    int scan_keys;
+    uint32_t key_counts[256];
+    
+    MidiFilter filter;
+    uint32_t track_index;
+    int mute_notes;             // tempo-only pass over an excluded conductor track
+    uint32_t skipped_tracks;
+    uint32_t filtered_keys;
+    
     int start_counter[3];
     
     MidiNote* notes;
     size_t notes_count;
     size_t notes_capacity;
     
+    int simplify;
+    SimplifyConfig simplify_cfg;
+    
+    int optimize;
+    
+    size_t mem_budget;
+    size_t notes_bytes;
+    MidiNote* spill_scratch;    // sort buffer reused by every spilled run
+    size_t spill_scratch_capacity;
+    FILE** runs;
+    size_t runs_count;
+    size_t runs_capacity;
+    int mapped;
+    size_t released_upto;
+    OutBuf* record_out;
+    
+    int fast_decode;
+    
     char** log_entries;
     size_t log_count;
     size_t log_capacity;
@@ -92,6 +214,7 @@ typedef struct {
 } MidiReader;
 
 MidiReader* midi_reader_init(const char* filename);
+void build_key_map(MidiReader* reader);
 void midi_reader_cleanup(MidiReader* reader);
 void process_midi_file(MidiReader* reader, const char* record_file);
 int check_start_sequence(MidiReader* reader);
@@ -103,13 +226,27 @@ char* read_text(MidiReader* reader, size_t length);
 int read_midi_meta_event(MidiReader* reader, uint32_t deltaT);
 void read_midi_track_event(MidiReader* reader, uint32_t length);
 void read_voice_event(MidiReader* reader, uint32_t deltaT);
+void emit_key_event(MidiReader* reader, int press, uint8_t key);
+size_t decode_note_run(MidiReader* reader, size_t end);
 void read_events(MidiReader* reader);
 void log_message(MidiReader* reader, const char* format, ...);
 uint32_t get_int(MidiReader* reader, size_t count);
+void add_note(MidiReader* reader, double time, const char* text);
+void reserve_notes(MidiReader* reader, size_t extra);
+void sort_notes(MidiNote* notes, size_t count);
+void sort_notes_with(MidiNote* notes, size_t count, MidiNote* tmp);
 void clean_notes(MidiReader* reader);
-void save_song(MidiReader* reader, const char* song_file);
-void save_sheet(MidiReader* reader, const char* sheet_file);
+void simplify_song(MidiReader* reader);
+void spill_run(MidiReader* reader);
+void release_consumed_input(MidiReader* reader);
+void process_midi_file_external(MidiReader* reader, const char* record_file,
+                                const char* song_file, const char* sheet_file);
+int outbuf_open(OutBuf* out, const char* path);
+void outbuf_write(OutBuf* out, const char* data, size_t len);
+int outbuf_close(OutBuf* out);
+int save_outputs(MidiReader* reader, const char* song_file, const char* sheet_file);
 void save_record(MidiReader* reader, const char* record_file);
+void report_left_out(MidiReader* reader);
 
 MidiReader* midi_reader_init(const char* filename) {
     MidiReader* reader = (MidiReader*)malloc(sizeof(MidiReader));
@@ -131,6 +268,7 @@ MidiReader* midi_reader_init(const char* filename) {
     
     reader->bytes = NULL;
     reader->bytes_size = 0;
+    reader->limit = 0;
     
     reader->filename = strdup(filename);
     reader->record_file = strdup("midiRecord.txt");
@@ -142,12 +280,46 @@ MidiReader* midi_reader_init(const char* filename) {
     
     strcpy(reader->piano_scale, "1!2@34$5%6^78*9(0qQwWeErtTyYuiIoOpPasSdDfgGhHjJklLzZxcCvVbBnm");
     
+    reader->fold = FOLD_WRAP;
+    reader->transpose = 0;
+    reader->dropped_keys = 0;
+    reader->scan_keys = 0;
+    memset(reader->key_counts, 0, sizeof(reader->key_counts));
+    
+    memset(&reader->filter, 0, sizeof(reader->filter));
+    reader->filter.channels = 0xFFFF;
+    reader->track_index = 0;
+    reader->mute_notes = 0;
+    reader->skipped_tracks = 0;
+    reader->filtered_keys = 0;
+    build_key_map(reader);
+    
     memset(reader->start_counter, 0, sizeof(reader->start_counter));
     
     reader->notes = NULL;
     reader->notes_count = 0;
     reader->notes_capacity = 0;
     
+    reader->simplify = 0;
+    reader->simplify_cfg.max_chord_keys = 6;
+    reader->simplify_cfg.max_events_per_sec = 120;
+    reader->simplify_cfg.max_span = 12;
+    
+    reader->optimize = 1;
+    
+    reader->mem_budget = 0;
+    reader->notes_bytes = 0;
+    reader->spill_scratch = NULL;
+    reader->spill_scratch_capacity = 0;
+    reader->runs = NULL;
+    reader->runs_count = 0;
+    reader->runs_capacity = 0;
+    reader->mapped = 0;
+    reader->released_upto = 0;
+    reader->record_out = NULL;
+    
+    reader->fast_decode = 1;
+    
     reader->log_entries = NULL;
     reader->log_count = 0;
     reader->log_capacity = 0;
@@ -162,7 +334,21 @@ void midi_reader_cleanup(MidiReader* reader) {
     
     free(reader->filename);
     free(reader->record_file);
-    free(reader->bytes);
+    if (reader->mapped) {
+        munmap(reader->bytes, reader->bytes_size);
+    } else {
+        free(reader->bytes);
+    }
+    
+    for (size_t i = 0; i < reader->runs_count; i++) {
+        if (reader->runs[i]) fclose(reader->runs[i]);
+    }
+    free(reader->runs);
+    free(reader->spill_scratch);
+    if (reader->record_out) {
+        outbuf_close(reader->record_out);
+        free(reader->record_out);
+    }
     
     for (size_t i = 0; i < reader->notes_count; i++) {
         free(reader->notes[i].note);
@@ -186,15 +372,19 @@ int check_start_sequence(MidiReader* reader) {
     return 0;
 }
 
+// Every read below is checked against reader->limit and every event moves
+// itr forward, and a track never reads past its own chunk, so parsing is
+// linear in the file size whatever the bytes say.
 void skip_bytes(MidiReader* reader, size_t count) {
-    reader->itr += count;
-    if (reader->itr > reader->bytes_size) {
-        reader->itr = reader->bytes_size;
+    if (count > reader->limit - reader->itr) {
+        reader->itr = reader->limit;
+    } else {
+        reader->itr += count;
     }
 }
 
 uint32_t read_variable_length(MidiReader* reader) {
-    if (!reader->bytes || reader->itr >= reader->bytes_size) {
+    if (!reader->bytes || reader->itr >= reader->limit) {
         return 0;
     }
     
@@ -202,7 +392,7 @@ uint32_t read_variable_length(MidiReader* reader) {
     uint8_t byte;
     
     do {
-        if (reader->itr >= reader->bytes_size) break;
+        if (reader->itr >= reader->limit) break;
         
         byte = reader->bytes[reader->itr++];
         value = (value << 7) | (byte & 0x7F);
@@ -217,25 +407,50 @@ void read_mthd(MidiReader* reader) {
     
     reader->format = get_int(reader, 2);
     reader->tracks = get_int(reader, 2);
+    reader->track_index = 0;
     
     uint16_t div = get_int(reader, 2);
     reader->division_type = (div & 0x8000) >> 15;
     reader->division = div & 0x7FFF;
+    if (reader->division == 0) {
+        log_message(reader, "Division is 0, using 480");
+        reader->division = 480;
+    }
     
     log_message(reader, "Format: %d, Tracks: %d, DivisionType: %d, Division: %d", 
                 reader->format, reader->tracks, reader->division_type, reader->division);
 }
 
 void read_mtrk(MidiReader* reader) {
+    TRACE_SCOPE("track");
+    
     uint32_t length = get_int(reader, 4);
     log_message(reader, "MTrk len: %u", length);
     
-    read_midi_track_event(reader, length);
+    reader->track_index++;
+    if (range_list_has(&reader->filter.tracks, reader->track_index)) {
+        read_midi_track_event(reader, length);
+        return;
+    }
+    
+    reader->skipped_tracks++;
+    
+    // Format 1 keeps the tempo map in the first track, so that one is still
+    // read for its tempo events. Every other excluded track is never decoded.
+    if (reader->format == 1 && reader->track_index == 1) {
+        reader->mute_notes = 1;
+        read_midi_track_event(reader, length);
+        reader->mute_notes = 0;
+        return;
+    }
+    
+    log_message(reader, "Skipping track %u (%u bytes)", reader->track_index, length);
+    skip_bytes(reader, length);
 }
 
 char* read_text(MidiReader* reader, size_t length) {
-    if (reader->itr + length > reader->bytes_size) {
-        length = reader->bytes_size - reader->itr;
+    if (length > reader->limit - reader->itr) {
+        length = reader->limit - reader->itr;
     }
     
     char* text = (char*)malloc(length + 1);
@@ -250,7 +465,7 @@ char* read_text(MidiReader* reader, size_t length) {
 }
 
 int read_midi_meta_event(MidiReader* reader, uint32_t deltaT) {
-    if (reader->itr >= reader->bytes_size) return 0;
+    if (reader->itr >= reader->limit) return 0;
     
     uint8_t type = reader->bytes[reader->itr++];
     uint32_t length = read_variable_length(reader);
@@ -267,7 +482,7 @@ int read_midi_meta_event(MidiReader* reader, uint32_t deltaT) {
     
     if (type == 0x2F) {
         log_message(reader, "END TRACK");
-        skip_bytes(reader, 2);
+        skip_bytes(reader, length);
         return 0;
     } else if (type >= 0x01 && type <= 0x0C && type != 0x0B) {
         char* text = read_text(reader, length);
@@ -275,19 +490,15 @@ int read_midi_meta_event(MidiReader* reader, uint32_t deltaT) {
             log_message(reader, "\t%s", text);
             free(text);
         }
-    } else if (type == 0x51) {
+    } else if (type == 0x51 && length >= 3 && reader->limit - reader->itr >= 3) {
         uint32_t tempoValue = get_int(reader, 3);
+        skip_bytes(reader, length - 3);
+        if (tempoValue == 0) return 1;
         reader->tempo = 60000000.0 / tempoValue;
 
-        if (reader->notes_count >= reader->notes_capacity) {
-            reader->notes_capacity = reader->notes_capacity ? reader->notes_capacity * 2 : 16;
-            reader->notes = realloc(reader->notes, sizeof(MidiNote) * reader->notes_capacity);
-        }
-        
-        reader->notes[reader->notes_count].time = reader->delta_time / reader->division;
-        reader->notes[reader->notes_count].note = malloc(32);
-        snprintf(reader->notes[reader->notes_count].note, 32, "tempo=%.0f", reader->tempo);
-        reader->notes_count++;
+        char tempo_str[32];
+        snprintf(tempo_str, sizeof(tempo_str), "tempo=%.0f", reader->tempo);
+        add_note(reader, reader->delta_time / reader->division, tempo_str);
         
         log_message(reader, "\tNew tempo is %.0f", reader->tempo);
     } else {
@@ -307,129 +518,246 @@ void read_midi_track_event(MidiReader* reader, uint32_t length) {
     reader->delta_time = 0;
     
     size_t start = reader->itr;
+    size_t end = length < reader->bytes_size - start ? start + length : reader->bytes_size;
     int continue_flag = 1;
     
-    while (reader->itr - start < length && continue_flag) {
+    reader->limit = end;
+    
+    while (reader->itr < end && continue_flag) {
+        release_consumed_input(reader);
+        
+        if (reader->fast_decode && decode_note_run(reader, end) > 0) {
+            continue;
+        }
+        
         uint32_t deltaT = read_variable_length(reader);
         reader->delta_time += deltaT;
         
-        if (reader->itr >= reader->bytes_size) {
+        if (reader->itr >= end) {
             log_message(reader, "Reached end of MIDI data unexpectedly.");
             break;
         }
         
-        if (reader->bytes[reader->itr] == 0xFF) {
+        uint8_t status = reader->bytes[reader->itr];
+        if (status == 0xFF) {
             reader->itr++;
             continue_flag = read_midi_meta_event(reader, deltaT);
-        } else if (reader->bytes[reader->itr] >= 0xF0 && reader->bytes[reader->itr] <= 0xF7) {
+        } else if (status == 0xF0 || status == 0xF7) {
+            reader->itr++;
+            uint32_t sysex_length = read_variable_length(reader);
+            skip_bytes(reader, sysex_length);
             reader->running_status_set = 0;
             reader->running_status = -1;
-            log_message(reader, "RUNNING STATUS SET: CLEARED");
+            log_message(reader, "SYSEX: %u bytes, RUNNING STATUS SET: CLEARED", sysex_length);
+        } else if (status > 0xF0) {
+            // System common and real-time bytes don't belong in a file; step over them.
+            reader->itr++;
+            skip_bytes(reader, status == 0xF2 ? 2 : status == 0xF1 || status == 0xF3 ? 1 : 0);
         } else {
             read_voice_event(reader, deltaT);
         }
     }
     
-    log_message(reader, "End of MTrk event, jumping from %zu to %zu", reader->itr, start + length);
-    reader->itr = start + length;
+    log_message(reader, "End of MTrk event, jumping from %zu to %zu", reader->itr, end);
+    reader->itr = end;
+    reader->limit = reader->bytes_size;
 }
 
 void read_voice_event(MidiReader* reader, uint32_t deltaT) {
-    if (reader->itr >= reader->bytes_size) return;
+    if (reader->itr >= reader->limit) return;
     
     uint8_t type;
-    uint8_t channel;
     
-    if (reader->bytes[reader->itr] < 0x80 && reader->running_status_set) {
+    if (reader->bytes[reader->itr] < 0x80) {
+        if (!reader->running_status_set) {
+            log_message(reader, "Stray data byte 0x%02X, DT: %u", reader->bytes[reader->itr], deltaT);
+            reader->itr++;
+            return;
+        }
         type = reader->running_status;
-        channel = type & 0x0F;
     } else {
-        type = reader->bytes[reader->itr];
-        channel = type & 0x0F;
+        type = reader->bytes[reader->itr++];
+        log_message(reader, "RUNNING STATUS SET: 0x%02X", type);
+        reader->running_status = type;
+        reader->running_status_set = 1;
+    }
+    
+    uint8_t channel = type & 0x0F;
+    int kind = type >> 4;
+    size_t data_length = kind == 0xC || kind == 0xD ? 1 : 2;
+    
+    if (reader->limit - reader->itr < data_length) {
+        reader->itr = reader->limit;
+        return;
+    }
+    
+    const uint8_t* data = reader->bytes + reader->itr;
+    reader->itr += data_length;
+    
+    if (reader->mute_notes || !((reader->filter.channels >> channel) & 1)) return;
+    
+    if (kind == 0x9) {
+        emit_key_event(reader, data[1] != 0, data[0]);
+    } else if (kind == 0x8) {
+        emit_key_event(reader, 0, data[0]);
+    } else if (data_length == 1) {
+        log_message(reader, "VoiceEvent: 0x%02X, 0x%02X, DT: %u", type, data[0], deltaT);
+    } else {
+        log_message(reader, "VoiceEvent: 0x%02X, 0x%02X, 0x%02X, DT: %u", type, data[0], data[1], deltaT);
+    }
+}
+
+// Lowest MIDI key on the piano; the scale runs up from here one semitone per key.
+#define PIANO_LOW_KEY 36
+
+// Fills key_map once so emit_key_event() is a single lookup. Keys the piano
+// doesn't reach are wrapped by octaves, pinned to the nearest end, or dropped.
+// Transpose shifts the whole song by reader->transpose octaves and wraps
+// whatever still doesn't fit. Data bytes past 127 only come from broken files
+// and get the same treatment instead of reading out of bounds.
+void build_key_map(MidiReader* reader) {
+    int size = (int)strlen(reader->piano_scale);
+    int shift = reader->fold == FOLD_TRANSPOSE ? reader->transpose * 12 : 0;
+    
+    for (int key = 0; key < 256; key++) {
+        int map = key + shift - PIANO_LOW_KEY;
+        
+        if (!range_list_has(&reader->filter.keys, key)) {
+            reader->key_map[key] = 0;
+            continue;
+        }
+        
+        if (map < 0 || map >= size) {
+            if (reader->fold == FOLD_DROP) {
+                reader->key_map[key] = 0;
+                continue;
+            }
+            if (reader->fold == FOLD_CLAMP) {
+                map = map < 0 ? 0 : size - 1;
+            } else {
+                while (map >= size) map -= 12;
+                while (map < 0) map += 12;
+            }
+        }
         
-        if (type >= 0x80 && type <= 0xF7) {
-            log_message(reader, "RUNNING STATUS SET: 0x%02X", type);
-            reader->running_status = type;
-            reader->running_status_set = 1;
+        reader->key_map[key] = reader->piano_scale[map];
+    }
+}
+
+void emit_key_event(MidiReader* reader, int press, uint8_t key) {
+    if (reader->scan_keys) {
+        if (press) reader->key_counts[key]++;
+        return;
+    }
+    
+    char piano_key = reader->key_map[key];
+    if (!piano_key) {
+        if (!press) return;
+        if (range_list_has(&reader->filter.keys, key)) {
+            reader->dropped_keys++;
+        } else {
+            reader->filtered_keys++;
         }
-        reader->itr++;
+        return;
     }
     
-    if ((type >> 4) == 0x9) {
-        if (reader->itr + 1 >= reader->bytes_size) return;
+    char note_str[2] = {piano_key, '\0'};
+    
+    if (press) {
+        log_message(reader, "%.2f %s", reader->delta_time / reader->division, note_str);
+        add_note(reader, reader->delta_time / reader->division, note_str);
+        reader->key_press_count++;
+    } else {
+        log_message(reader, "%.2f ~%s", reader->delta_time / reader->division, note_str);
         
-        uint8_t key = reader->bytes[reader->itr++];
-        uint8_t velocity = reader->bytes[reader->itr++];
+        char release_str[3] = {'~', piano_key, '\0'};
+        add_note(reader, reader->delta_time / reader->division, release_str);
+    }
+}
+
+#if defined(__AVX2__)
+#define FAST_BLOCK_EVENTS 32
+
+int block_is_plain(const uint8_t* p) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(p + 64));
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b), c)) == 0;
+}
+#elif defined(__SSE2__)
+#define FAST_BLOCK_EVENTS 16
+
+int block_is_plain(const uint8_t* p) {
+    __m128i a = _mm_loadu_si128((const __m128i*)p);
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), c)) == 0;
+}
+#else
+#define FAST_BLOCK_EVENTS 16
+
+int block_is_plain(const uint8_t* p) {
+    uint64_t acc = 0;
+    for (int i = 0; i < 6; i++) {
+        uint64_t word;
+        memcpy(&word, p + i * 8, sizeof(word));
+        acc |= word;
+    }
+    return (acc & 0x8080808080808080ULL) == 0;
+}
+#endif
+
+#define FAST_BLOCK_BYTES (FAST_BLOCK_EVENTS * 3)
+
+// Black-MIDI fast path: long runs of running-status Note On/Off with one-byte
+// deltas. A block with no byte >= 0x80 holds no status byte and no VLQ
+// continuation, so it can only be whole [delta][key][velocity] triples.
+// Anything else falls back to the scalar path one event at a time.
+size_t decode_note_run(MidiReader* reader, size_t end) {
+    if (!reader->running_status_set) return 0;
+    
+    int kind = (reader->running_status >> 4) & 0x0F;
+    if (kind != 0x8 && kind != 0x9) return 0;
+    
+    if (end > reader->limit) end = reader->limit;
+    
+    // Excluded channels still have to advance the clock, they just emit nothing.
+    int channel = reader->running_status & 0x0F;
+    int keep = !reader->mute_notes && ((reader->filter.channels >> channel) & 1);
+    
+    size_t decoded = 0;
+    while (reader->itr + FAST_BLOCK_BYTES <= end) {
+        // One run can be the whole track, so drop read pages from in here too.
+        release_consumed_input(reader);
         
-        int map = key - 23 - 12 - 1;
-        while (map >= strlen(reader->piano_scale)) map -= 12;
-        while (map < 0) map += 12;
+        const uint8_t* p = reader->bytes + reader->itr;
+        if (!block_is_plain(p)) break;
         
-        if (velocity == 0) {
-            char note_str[2] = {reader->piano_scale[map], '\0'};
-            log_message(reader, "%.2f ~%s", reader->delta_time / reader->division, note_str);
+        if (keep) {
+            reserve_notes(reader, FAST_BLOCK_EVENTS);
             
-            if (reader->notes_count >= reader->notes_capacity) {
-                reader->notes_capacity = reader->notes_capacity ? reader->notes_capacity * 2 : 16;
-                reader->notes = realloc(reader->notes, sizeof(MidiNote) * reader->notes_capacity);
+            for (int i = 0; i < FAST_BLOCK_EVENTS; i++, p += 3) {
+                reader->delta_time += p[0];
+                emit_key_event(reader, kind == 0x9 && p[2] != 0, p[1]);
             }
-            
-            reader->notes[reader->notes_count].time = reader->delta_time / reader->division;
-            reader->notes[reader->notes_count].note = malloc(3);
-            snprintf(reader->notes[reader->notes_count].note, 3, "~%c", reader->piano_scale[map]);
-            reader->notes_count++;
-        } else { 
-            char note_str[2] = {reader->piano_scale[map], '\0'};
-            log_message(reader, "%.2f %s", reader->delta_time / reader->division, note_str);
-            
-            if (reader->notes_count >= reader->notes_capacity) {
-                reader->notes_capacity = reader->notes_capacity ? reader->notes_capacity * 2 : 16;
-                reader->notes = realloc(reader->notes, sizeof(MidiNote) * reader->notes_capacity);
+        } else {
+            for (int i = 0; i < FAST_BLOCK_EVENTS; i++, p += 3) {
+                reader->delta_time += p[0];
             }
-            
-            reader->notes[reader->notes_count].time = reader->delta_time / reader->division;
-            reader->notes[reader->notes_count].note = malloc(2);
-            snprintf(reader->notes[reader->notes_count].note, 2, "%c", reader->piano_scale[map]);
-            reader->notes_count++;
-            
-            reader->key_press_count++;
         }
-    } else if ((type >> 4) == 0x8) { 
-        if (reader->itr + 1 >= reader->bytes_size) return;
-        
-        uint8_t key = reader->bytes[reader->itr++];
-        uint8_t velocity = reader->bytes[reader->itr++];
-        
-        int map = key - 23 - 12 - 1;
-        while (map >= strlen(reader->piano_scale)) map -= 12;
-        while (map < 0) map += 12;
         
-        char note_str[2] = {reader->piano_scale[map], '\0'};
-        log_message(reader, "%.2f ~%s", reader->delta_time / reader->division, note_str);
-        
-        if (reader->notes_count >= reader->notes_capacity) {
-            reader->notes_capacity = reader->notes_capacity ? reader->notes_capacity * 2 : 16;
-            reader->notes = realloc(reader->notes, sizeof(MidiNote) * reader->notes_capacity);
-        }
-        
-        reader->notes[reader->notes_count].time = reader->delta_time / reader->division;
-        reader->notes[reader->notes_count].note = malloc(3);
-        snprintf(reader->notes[reader->notes_count].note, 3, "~%c", reader->piano_scale[map]);
-        reader->notes_count++;
-    } else if ((type >> 4) != 0x8 && (type >> 4) != 0x9 && 
-               (type >> 4) != 0xA && (type >> 4) != 0xB && 
-               (type >> 4) != 0xD && (type >> 4) != 0xE) {
-        log_message(reader, "VoiceEvent: 0x%02X, 0x%02X, DT: %u", 
-                   type, reader->bytes[reader->itr], deltaT);
-        reader->itr++;
-    } else {
-        log_message(reader, "VoiceEvent: 0x%02X, 0x%02X, 0x%02X, DT: %u", 
-                   type, reader->bytes[reader->itr], reader->bytes[reader->itr + 1], deltaT);
-        reader->itr += 2;
+        reader->itr += FAST_BLOCK_BYTES;
+        decoded += FAST_BLOCK_EVENTS;
     }
+    
+    return decoded;
 }
 
 void read_events(MidiReader* reader) {
+    TRACE_SCOPE("read_events");
+    
+    reader->limit = reader->bytes_size;
+    
     while (reader->itr + 1 < reader->bytes_size) {
         memset(reader->start_counter, 0, sizeof(reader->start_counter));
 
@@ -482,6 +810,13 @@ void log_message(MidiReader* reader, const char* format, ...) {
     
     printf("%s\n", buffer);
     
+    if (reader->record_out) {
+        buffer[needed] = '\n';
+        outbuf_write(reader->record_out, buffer, needed + 1);
+        free(buffer);
+        return;
+    }
+    
     if (reader->log_count >= reader->log_capacity) {
         reader->log_capacity = reader->log_capacity ? reader->log_capacity * 2 : 16;
         reader->log_entries = realloc(reader->log_entries, sizeof(char*) * reader->log_capacity);
@@ -491,8 +826,8 @@ void log_message(MidiReader* reader, const char* format, ...) {
 }
 
 uint32_t get_int(MidiReader* reader, size_t count) {
-    if (reader->itr + count > reader->bytes_size) {
-        count = reader->bytes_size - reader->itr;
+    if (count > reader->limit - reader->itr) {
+        count = reader->limit - reader->itr;
     }
     
     uint32_t value = 0;
@@ -503,224 +838,1719 @@ uint32_t get_int(MidiReader* reader, size_t count) {
     return value;
 }
 
-void clean_notes(MidiReader* reader) {
-    for (size_t i = 0; i < reader->notes_count - 1; i++) {
-        for (size_t j = i + 1; j < reader->notes_count; j++) {
-            if (reader->notes[i].time > reader->notes[j].time) {
-                MidiNote temp = reader->notes[i];
-                reader->notes[i] = reader->notes[j];
-                reader->notes[j] = temp;
-            }
-        }
-    }
+void reserve_notes(MidiReader* reader, size_t extra) {
+    if (reader->notes_count + extra <= reader->notes_capacity) return;
     
-    if (reader->verbose) {
-        for (size_t i = 0; i < reader->notes_count; i++) {
-            printf("%.2f: %s\n", reader->notes[i].time, reader->notes[i].note);
-        }
+    size_t capacity = reader->notes_capacity ? reader->notes_capacity : 16;
+    while (capacity < reader->notes_count + extra) capacity *= 2;
+    
+    reader->notes = realloc(reader->notes, sizeof(MidiNote) * capacity);
+    reader->notes_capacity = capacity;
+}
+
+// Runs spill at half the budget: the sort needs a scratch copy of the run's
+// array, and the array itself can have up to twice the slots in use.
+void add_note(MidiReader* reader, double time, const char* text) {
+    if (reader->mem_budget && reader->notes_bytes >= reader->mem_budget / 2) {
+        spill_run(reader);
     }
     
-    size_t i = 0;
-    while (i < reader->notes_count - 1) {
-        double a_time = reader->notes[i].time;
-        double b_time = reader->notes[i + 1].time;
-        
-        if (a_time == b_time) {
-            char* a_note = reader->notes[i].note;
-            char* b_note = reader->notes[i + 1].note;
+    reserve_notes(reader, 1);
+    
+    reader->notes[reader->notes_count].time = time;
+    reader->notes[reader->notes_count].note = strdup(text);
+    reader->notes_count++;
+    
+    // What malloc really hands out for the string: a 16-byte aligned chunk
+    // with an 8-byte header, never under 32 bytes.
+    size_t chunk = (strlen(text) + 1 + 8 + 15) & ~(size_t)15;
+    reader->notes_bytes += sizeof(MidiNote) + (chunk < 32 ? 32 : chunk);
+}
+
+// Stable bottom-up merge sort, so events at the same tick keep their file order.
+void sort_notes(MidiNote* notes, size_t count) {
+    if (count < 2) return;
+    
+    MidiNote* tmp = malloc(sizeof(MidiNote) * count);
+    if (!tmp) return;
+    
+    sort_notes_with(notes, count, tmp);
+    free(tmp);
+}
+
+// The sort itself, with a scratch buffer of at least count notes.
+void sort_notes_with(MidiNote* notes, size_t count, MidiNote* tmp) {
+    if (count < 2) return;
+    
+    MidiNote* src = notes;
+    MidiNote* dst = tmp;
+    
+    for (size_t width = 1; width < count; width *= 2) {
+        for (size_t lo = 0; lo < count; lo += 2 * width) {
+            size_t mid = lo + width < count ? lo + width : count;
+            size_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+            size_t a = lo, b = mid, out = lo;
             
-            if (strstr(a_note, "tempo") == NULL && strstr(b_note, "tempo") == NULL &&
-                strchr(a_note, '~') == NULL && strchr(b_note, '~') == NULL) {
-                size_t new_len = strlen(a_note) + strlen(b_note) + 1;
-                char* combined = malloc(new_len);
-                if (combined) {
-                    snprintf(combined, new_len, "%s%s", a_note, b_note);
-                    free(reader->notes[i].note);
-                    reader->notes[i].note = combined;
-
-                    free(reader->notes[i + 1].note);
-                    for (size_t j = i + 1; j < reader->notes_count - 1; j++) {
-                        reader->notes[j] = reader->notes[j + 1];
-                    }
-                    reader->notes_count--;
-                } else {
-                    i++;
-                }
-            } else {
-                i++;
+            while (a < mid && b < hi) {
+                dst[out++] = src[b].time < src[a].time ? src[b++] : src[a++];
             }
-        } else {
-            i++;
+            while (a < mid) dst[out++] = src[a++];
+            while (b < hi) dst[out++] = src[b++];
         }
+        
+        MidiNote* swap = src;
+        src = dst;
+        dst = swap;
+    }
+    
+    if (src != notes) {
+        memcpy(notes, src, sizeof(MidiNote) * count);
     }
+}
 
-    for (size_t q = 0; q < reader->notes_count; q++) {
-        char* note = reader->notes[q].note;
-        if (strstr(note, "tempo") == NULL && strchr(note, '~') == NULL) {
-            int char_count[256] = {0};
-            char* new_note = malloc(strlen(note) + 1);
-            if (!new_note) continue;
-            
-            size_t new_idx = 0;
-            for (size_t i = 0; i < strlen(note); i++) {
-                unsigned char c = note[i];
-                if (char_count[c] == 0) {
-                    new_note[new_idx++] = c;
-                    char_count[c] = 1;
-                }
+int is_press(const char* note) {
+    return note[0] != '~' && strncmp(note, "tempo=", 6) != 0;
+}
+
+typedef void (*NoteSink)(void* ctx, MidiNote note);
+
+// Merges same-time key presses into one chord and drops repeated keys in it.
+// Takes notes in sorted order, hands finished ones to the sink.
+typedef struct {
+    MidiNote pending;
+    size_t pending_len;
+    size_t pending_capacity;
+    int has_pending;
+    NoteSink sink;
+    void* ctx;
+} NoteCleaner;
+
+void cleaner_flush(NoteCleaner* cleaner) {
+    if (!cleaner->has_pending) return;
+    
+    char* note = cleaner->pending.note;
+    if (is_press(note)) {
+        int seen[256] = {0};
+        size_t out = 0;
+        for (size_t i = 0; note[i]; i++) {
+            unsigned char c = note[i];
+            if (!seen[c]) {
+                note[out++] = c;
+                seen[c] = 1;
             }
-            new_note[new_idx] = '\0';
-            
-            free(reader->notes[q].note);
-            reader->notes[q].note = new_note;
         }
+        note[out] = '\0';
     }
+    
+    cleaner->sink(cleaner->ctx, cleaner->pending);
+    cleaner->has_pending = 0;
 }
 
-void save_song(MidiReader* reader, const char* song_file) {
-    printf("Saving notes to %s\n", song_file);
-    
-    FILE* file = fopen(song_file, "w");
-    if (!file) {
-        perror("Error opening song file");
-        return;
+void cleaner_feed(NoteCleaner* cleaner, MidiNote note) {
+    if (cleaner->has_pending && cleaner->pending.time == note.time &&
+        is_press(cleaner->pending.note) && is_press(note.note)) {
+        size_t len = strlen(note.note);
+        
+        if (cleaner->pending_len + len + 1 > cleaner->pending_capacity) {
+            size_t capacity = (cleaner->pending_len + len + 1) * 2;
+            char* grown = realloc(cleaner->pending.note, capacity);
+            if (grown) {
+                cleaner->pending.note = grown;
+                cleaner->pending_capacity = capacity;
+            }
+        }
+        
+        if (cleaner->pending_len + len + 1 <= cleaner->pending_capacity) {
+            memcpy(cleaner->pending.note + cleaner->pending_len, note.note, len + 1);
+            cleaner->pending_len += len;
+            free(note.note);
+            return;
+        }
     }
     
-    fprintf(file, "playback_speed=1.1\n");
-    for (size_t i = 0; i < reader->notes_count; i++) {
-        fprintf(file, "%.2f %s\n", reader->notes[i].time, reader->notes[i].note);
-    }
+    cleaner_flush(cleaner);
     
-    fclose(file);
+    cleaner->pending = note;
+    cleaner->pending_len = strlen(note.note);
+    cleaner->pending_capacity = cleaner->pending_len + 1;
+    cleaner->has_pending = 1;
 }
 
-void save_sheet(MidiReader* reader, const char* sheet_file) {
-    printf("Saving sheets to %s\n", sheet_file);
+// Drops events that can't change what gets played. Works one time step at a
+// time over the cleaned stream, with a held flag per piano key (after
+// folding, so two MIDI notes landing on one key count as one):
+//   - a release of a key that isn't held
+//   - a tempo that doesn't change the tempo
+// Every press is a key strike in play_core, so presses are all kept. A press
+// of a key that is still held gets a release in front of it, and a press and
+// release in one step (zero-length note) keeps both.
+// Each step comes out as at most one release line, one tempo, one chord and
+// a release line for its zero-length notes.
+typedef struct {
+    uint8_t held[256];
+    uint8_t pressed[256];
+    uint8_t released[256];
+    char press_keys[257];
+    char release_keys[258];
+    size_t press_len;
+    size_t release_len;
+    char* tempo;
+    double current_tempo;
+    double time;
+    int has_step;
+    NoteSink sink;
+    void* ctx;
+    
+    size_t events_in;
+    size_t events_out;
+    size_t orphan_releases;
+    size_t repeated_tempos;
+    size_t keys_saved;
+} EventOptimizer;
+
+void optimizer_emit(EventOptimizer* opt, const char* text) {
+    MidiNote note = {opt->time, strdup(text)};
+    if (!note.note) return;
+    opt->sink(opt->ctx, note);
+    opt->events_out++;
+}
+
+void optimizer_flush(EventOptimizer* opt) {
+    if (!opt->has_step) return;
+    opt->has_step = 0;
+    
+    char releases[258] = "~";
+    char after[258] = "~";
+    size_t release_out = 1;
+    size_t after_out = 1;
+    for (size_t i = 0; i < opt->release_len; i++) {
+        unsigned char c = opt->release_keys[i];
+        if (opt->held[c]) {
+            releases[release_out++] = c;
+        } else if (opt->pressed[c]) {
+            after[after_out++] = c;
+        } else {
+            opt->orphan_releases++;
+            opt->keys_saved++;
+        }
+        opt->held[c] = 0;
+        opt->released[c] = 0;
+    }
     
-    FILE* file = fopen(sheet_file, "w");
-    if (!file) {
-        perror("Error opening sheet file");
-        return;
+    char presses[257];
+    size_t press_out = 0;
+    for (size_t i = 0; i < opt->press_len; i++) {
+        unsigned char c = opt->press_keys[i];
+        if (!opt->pressed[c]) continue;
+        
+        // Still held from before: let it go so the press strikes again.
+        if (opt->held[c]) releases[release_out++] = c;
+        presses[press_out++] = c;
+        opt->held[c] = 1;
+        opt->pressed[c] = 0;
     }
+    presses[press_out] = '\0';
+    releases[release_out] = '\0';
     
-    int note_count = 0;
-    for (size_t i = 0; i < reader->notes_count; i++) {
-        if (strstr(reader->notes[i].note, "tempo") == NULL && 
-            strchr(reader->notes[i].note, '~') == NULL) {
-            const char* note = reader->notes[i].note;
-            
-            if (strlen(note) > 1) {
-                fprintf(file, "[%s] ", note);
-            } else {
-                fprintf(file, "%s ", note);
-            }
-            
-            note_count++;
-            
-            if (note_count % 8 == 0) {
-                fprintf(file, "\n");
-            }
-            
-            if (note_count % 32 == 0) {
-                fprintf(file, "\n\n");
-            }
-        }
+    for (size_t i = 1; i < after_out; i++) {
+        opt->held[(unsigned char)after[i]] = 0;
     }
+    after[after_out] = '\0';
     
-    fclose(file);
-}
-
-void save_record(MidiReader* reader, const char* record_file) {
-    printf("Saving processing log to %s\n", record_file);
+    if (release_out > 1) optimizer_emit(opt, releases);
     
-    FILE* file = fopen(record_file, "w");
-    if (!file) {
-        perror("Error opening record file");
-        return;
+    if (opt->tempo) {
+        double tempo = atof(opt->tempo + 6);
+        if (tempo != opt->current_tempo) {
+            opt->current_tempo = tempo;
+            optimizer_emit(opt, opt->tempo);
+        } else {
+            opt->repeated_tempos++;
+        }
+        free(opt->tempo);
+        opt->tempo = NULL;
     }
     
-    for (size_t i = 0; i < reader->log_count; i++) {
-        fprintf(file, "%s\n", reader->log_entries[i]);
-    }
+    if (press_out) optimizer_emit(opt, presses);
+    if (after_out > 1) optimizer_emit(opt, after);
     
-    fclose(file);
+    opt->press_len = 0;
+    opt->release_len = 0;
 }
 
-void process_midi_file(MidiReader* reader, const char* record_file) {
-    FILE* file = fopen(reader->filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Error: Could not open MIDI file %s\n", reader->filename);
-        reader->success = 0;
-        return;
+void optimizer_feed(EventOptimizer* opt, MidiNote note) {
+    if (opt->has_step && note.time != opt->time) {
+        optimizer_flush(opt);
     }
-
-    fseek(file, 0, SEEK_END);
-    reader->bytes_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    reader->bytes = (uint8_t*)malloc(reader->bytes_size);
-    if (!reader->bytes) {
-        fclose(file);
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        reader->success = 0;
+    opt->time = note.time;
+    opt->has_step = 1;
+    opt->events_in++;
+    
+    if (strncmp(note.note, "tempo=", 6) == 0) {
+        // Only the last tempo of a step counts.
+        if (opt->tempo) opt->repeated_tempos++;
+        free(opt->tempo);
+        opt->tempo = note.note;
         return;
     }
     
-    size_t bytes_read = fread(reader->bytes, 1, reader->bytes_size, file);
-    fclose(file);
+    int release = note.note[0] == '~';
+    uint8_t* seen = release ? opt->released : opt->pressed;
+    char* keys = release ? opt->release_keys : opt->press_keys;
+    size_t* len = release ? &opt->release_len : &opt->press_len;
     
-    if (bytes_read != reader->bytes_size) {
-        fprintf(stderr, "Error: Failed to read complete file\n");
-        free(reader->bytes);
-        reader->bytes = NULL;
-        reader->success = 0;
-        return;
+    for (const char* c = note.note + release; *c; c++) {
+        unsigned char key = *c;
+        if (seen[key]) {
+            if (!release) opt->keys_saved++;
+            continue;
+        }
+        seen[key] = 1;
+        keys[(*len)++] = key;
     }
     
-    printf("Processing %s\n", reader->filename);
+    free(note.note);
+}
 
-    read_events(reader);
-    
-    printf("%u notes processed. Your MIDI survived!\n", reader->key_press_count);
-    
-    clean_notes(reader);
-    reader->success = 1;
+void optimizer_sink(void* ctx, MidiNote note) {
+    optimizer_feed(ctx, note);
+}
 
-    if (reader->success && reader->notes_count > 0) {
-        reader->notes[reader->notes_count - 1].time = 1.00;
-    }
+void optimizer_report(EventOptimizer* opt, MidiReader* reader) {
+    printf("Optimized: %zu events -> %zu, %zu key events saved "
+           "(%zu orphan releases, %zu repeated tempos)\n",
+           opt->events_in, opt->events_out, opt->keys_saved,
+           opt->orphan_releases, opt->repeated_tempos);
+    log_message(reader, "OPTIMIZE: %zu events -> %zu, %zu key events saved",
+                opt->events_in, opt->events_out, opt->keys_saved);
+}
 
-    save_record(reader, record_file);
+typedef struct {
+    MidiNote* notes;
+    size_t count;
+} NoteArraySink;
+
+void note_array_sink(void* ctx, MidiNote note) {
+    NoteArraySink* out = ctx;
+    out->notes[out->count++] = note;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <midi_file>\n", argv[0]);
-        return 1;
-    }
+void reader_note_sink(void* ctx, MidiNote note) {
+    MidiReader* reader = ctx;
+    reserve_notes(reader, 1);
+    reader->notes[reader->notes_count++] = note;
+}
+
+void clean_notes(MidiReader* reader) {
+    TRACE_SCOPE("clean_notes");
     
-    const char* midi_file = argv[1];
-    if (!strstr(midi_file, ".mid") && !strstr(midi_file, ".MID")) {
-        fprintf(stderr, "Error: File must have .mid extension\n");
+    sort_notes(reader->notes, reader->notes_count);
+    
+    if (reader->verbose) {
+        for (size_t i = 0; i < reader->notes_count; i++) {
+            printf("%.2f: %s\n", reader->notes[i].time, reader->notes[i].note);
+        }
+    }
+    
+    // The cleaner lags its input, so writing back into the same array is safe.
+    NoteArraySink out = {reader->notes, 0};
+    NoteCleaner cleaner = {0};
+    cleaner.sink = note_array_sink;
+    cleaner.ctx = &out;
+    
+    for (size_t i = 0; i < reader->notes_count; i++) {
+        cleaner_feed(&cleaner, reader->notes[i]);
+    }
+    cleaner_flush(&cleaner);
+    reader->notes_count = out.count;
+    
+    EventOptimizer* opt = reader->optimize ? calloc(1, sizeof(EventOptimizer)) : NULL;
+    if (!opt) return;
+    
+    // The optimizer can put a release in front of a press, so it may emit
+    // more than it reads and gets a fresh array.
+    MidiNote* cleaned = reader->notes;
+    size_t cleaned_count = reader->notes_count;
+    reader->notes = NULL;
+    reader->notes_count = 0;
+    reader->notes_capacity = 0;
+    
+    opt->sink = reader_note_sink;
+    opt->ctx = reader;
+    for (size_t i = 0; i < cleaned_count; i++) {
+        optimizer_feed(opt, cleaned[i]);
+    }
+    optimizer_flush(opt);
+    optimizer_report(opt, reader);
+    
+    free(opt);
+    free(cleaned);
+}
+
+// Tracks tempo so the simplifier gets real seconds instead of beats.
+typedef struct {
+    Simplifier simplifier;
+    double bpm;
+    double last_beat;
+    double seconds;
+} SongSimplifier;
+
+void song_simplifier_init(SongSimplifier* ss, MidiReader* reader) {
+    simplifier_init(&ss->simplifier, &reader->simplify_cfg, reader->piano_scale);
+    ss->bpm = 120.0;
+    ss->last_beat = 0;
+    ss->seconds = 0;
+}
+
+// Returns 0 when the note got simplified away entirely.
+int song_simplifier_feed(SongSimplifier* ss, MidiNote* note) {
+    ss->seconds += (note->time - ss->last_beat) * 60.0 / ss->bpm;
+    ss->last_beat = note->time;
+    
+    if (strncmp(note->note, "tempo=", 6) == 0) {
+        double new_bpm = atof(note->note + 6);
+        if (new_bpm > 0) ss->bpm = new_bpm;
+        return 1;
+    }
+    
+    return simplifier_feed(&ss->simplifier, ss->seconds, note->note) != 0;
+}
+
+void song_simplifier_report(SongSimplifier* ss, MidiReader* reader) {
+    printf("Simplified: removed %zu key events\n", ss->simplifier.removed);
+    log_message(reader, "SIMPLIFY: removed %zu key events (chord<=%d, eps<=%d, span<=%d)",
+                ss->simplifier.removed, reader->simplify_cfg.max_chord_keys,
+                reader->simplify_cfg.max_events_per_sec, reader->simplify_cfg.max_span);
+    simplifier_cleanup(&ss->simplifier);
+}
+
+void simplify_song(MidiReader* reader) {
+    TRACE_SCOPE("simplify_song");
+    
+    SongSimplifier ss;
+    song_simplifier_init(&ss, reader);
+    
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < reader->notes_count; i++) {
+        MidiNote note = reader->notes[i];
+        
+        if (!song_simplifier_feed(&ss, &note)) {
+            free(note.note);
+            continue;
+        }
+        
+        reader->notes[kept++] = note;
+    }
+    
+    reader->notes_count = kept;
+    song_simplifier_report(&ss, reader);
+}
+
+// External-memory mode: notes past the budget get sorted and spilled to
+// temp files, then merged back while the outputs are written.
+int write_run_note(FILE* run, const MidiNote* note) {
+    uint32_t len = strlen(note->note);
+    return fwrite(&note->time, sizeof(double), 1, run) == 1 &&
+           fwrite(&len, sizeof(len), 1, run) == 1 &&
+           fwrite(note->note, 1, len, run) == len;
+}
+
+int read_run_note(FILE* run, MidiNote* note) {
+    uint32_t len;
+    if (fread(&note->time, sizeof(double), 1, run) != 1) return 0;
+    if (fread(&len, sizeof(len), 1, run) != 1) return 0;
+    
+    note->note = malloc(len + 1);
+    if (!note->note) return 0;
+    if (fread(note->note, 1, len, run) != len) {
+        free(note->note);
+        return 0;
+    }
+    note->note[len] = '\0';
+    return 1;
+}
+
+void add_run(MidiReader* reader, FILE* run) {
+    if (reader->runs_count >= reader->runs_capacity) {
+        reader->runs_capacity = reader->runs_capacity ? reader->runs_capacity * 2 : 16;
+        reader->runs = realloc(reader->runs, sizeof(FILE*) * reader->runs_capacity);
+    }
+    reader->runs[reader->runs_count++] = run;
+}
+
+void spill_run(MidiReader* reader) {
+    TRACE_SCOPE("spill_run");
+    
+    if (reader->notes_count == 0) return;
+    
+    // One scratch buffer for all runs: a fresh one per run would leave the
+    // heap fragmented well past the budget.
+    if (reader->spill_scratch_capacity < reader->notes_count) {
+        free(reader->spill_scratch);
+        reader->spill_scratch_capacity = reader->notes_capacity;
+        reader->spill_scratch = malloc(sizeof(MidiNote) * reader->spill_scratch_capacity);
+        if (!reader->spill_scratch) {
+            perror("Error allocating spill buffer");
+            exit(1);
+        }
+    }
+    sort_notes_with(reader->notes, reader->notes_count, reader->spill_scratch);
+    
+    FILE* run = tmpfile();
+    if (!run) {
+        perror("Error creating spill file");
+        exit(1);
+    }
+    
+    for (size_t i = 0; i < reader->notes_count; i++) {
+        if (!write_run_note(run, &reader->notes[i])) {
+            perror("Error writing spill file");
+            exit(1);
+        }
+        free(reader->notes[i].note);
+    }
+    rewind(run);
+    
+    log_message(reader, "SPILL: run %zu, %zu notes", reader->runs_count, reader->notes_count);
+    add_run(reader, run);
+    
+    reader->notes_count = 0;
+    reader->notes_bytes = 0;
+}
+
+// Maps the file instead of reading it in, so read_events can drop pages it's
+// done with and a huge input never sits in memory whole.
+int map_midi_bytes(MidiReader* reader) {
+    FILE* file = fopen(reader->filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open MIDI file %s\n", reader->filename);
+        return 0;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    reader->bytes_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    if (reader->bytes_size == 0) {
+        fclose(file);
+        fprintf(stderr, "Error: Empty MIDI file\n");
+        return 0;
+    }
+    
+    void* map = mmap(NULL, reader->bytes_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (map == MAP_FAILED) {
+        perror("Error mapping MIDI file");
+        return 0;
+    }
+    
+    madvise(map, reader->bytes_size, MADV_SEQUENTIAL);
+    reader->bytes = map;
+    reader->mapped = 1;
+    return 1;
+}
+
+// Hands the pages we already decoded back to the kernel so a huge input doesn't pin RSS.
+// They go back in chunks of an eighth of the budget, at most 16 MB.
+void release_consumed_input(MidiReader* reader) {
+    if (!reader->mapped) return;
+    
+    size_t page = 4096;
+    size_t chunk = reader->mem_budget / 8 < (16u << 20) ? reader->mem_budget / 8 : (16u << 20);
+    size_t upto = reader->itr & ~(page - 1);
+    if (upto >= reader->released_upto + (chunk > page ? chunk : page)) {
+        madvise(reader->bytes + reader->released_upto, upto - reader->released_upto, MADV_DONTNEED);
+        reader->released_upto = upto;
+    }
+}
+
+typedef struct {
+    MidiNote note;
+    size_t run;
+} MergeHead;
+
+int merge_head_before(const MergeHead* a, const MergeHead* b) {
+    if (a->note.time != b->note.time) return a->note.time < b->note.time;
+    return a->run < b->run;
+}
+
+void merge_sift_down(MergeHead* heap, size_t count, size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t l = 2 * i + 1, r = 2 * i + 2;
+        if (l < count && merge_head_before(&heap[l], &heap[smallest])) smallest = l;
+        if (r < count && merge_head_before(&heap[r], &heap[smallest])) smallest = r;
+        if (smallest == i) return;
+        
+        MergeHead tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// K-way merge in time order; ties go to the earlier run so the merge stays stable.
+void merge_runs(FILE** runs, size_t count, NoteSink sink, void* ctx) {
+    TRACE_SCOPE("merge_runs");
+    
+    MergeHead* heap = malloc(sizeof(MergeHead) * (count ? count : 1));
+    if (!heap) return;
+    
+    size_t heap_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (read_run_note(runs[i], &heap[heap_count].note)) {
+            heap[heap_count++].run = i;
+        }
+    }
+    for (size_t i = heap_count; i-- > 0;) {
+        merge_sift_down(heap, heap_count, i);
+    }
+    
+    while (heap_count > 0) {
+        size_t run = heap[0].run;
+        sink(ctx, heap[0].note);
+        
+        if (read_run_note(runs[run], &heap[0].note)) {
+            heap[0].run = run;
+        } else {
+            heap[0] = heap[--heap_count];
+        }
+        merge_sift_down(heap, heap_count, 0);
+    }
+    
+    free(heap);
+}
+
+void run_file_sink(void* ctx, MidiNote note) {
+    if (!write_run_note(ctx, &note)) {
+        perror("Error writing spill file");
+        exit(1);
+    }
+    free(note.note);
+}
+
+#define MERGE_FAN_IN 64
+
+// Keeps the number of open runs under MERGE_FAN_IN by merging them in groups.
+void reduce_runs(MidiReader* reader) {
+    TRACE_SCOPE("reduce_runs");
+    
+    while (reader->runs_count > MERGE_FAN_IN) {
+        size_t merged = 0;
+        
+        for (size_t first = 0; first < reader->runs_count; first += MERGE_FAN_IN) {
+            size_t count = reader->runs_count - first < MERGE_FAN_IN ? reader->runs_count - first : MERGE_FAN_IN;
+            
+            FILE* out = tmpfile();
+            if (!out) {
+                perror("Error creating spill file");
+                exit(1);
+            }
+            
+            merge_runs(reader->runs + first, count, run_file_sink, out);
+            rewind(out);
+            
+            for (size_t i = 0; i < count; i++) {
+                fclose(reader->runs[first + i]);
+            }
+            reader->runs[merged++] = out;
+        }
+        
+        log_message(reader, "MERGE PASS: %zu runs -> %zu", reader->runs_count, merged);
+        reader->runs_count = merged;
+    }
+}
+
+int outbuf_open(OutBuf* out, const char* path) {
+    out->len = 0;
+    out->failed = 0;
+    out->buf = malloc(OUTPUT_BUFFER_SIZE);
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (!out->buf || out->fd < 0) {
+        free(out->buf);
+        out->buf = NULL;
+        if (out->fd >= 0) close(out->fd);
+        out->fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+void outbuf_raw_write(OutBuf* out, const char* data, size_t len) {
+    while (len > 0 && !out->failed) {
+        ssize_t written = write(out->fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            out->failed = 1;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+void outbuf_flush(OutBuf* out) {
+    outbuf_raw_write(out, out->buf, out->len);
+    out->len = 0;
+}
+
+void outbuf_write(OutBuf* out, const char* data, size_t len) {
+    if (out->len + len > OUTPUT_BUFFER_SIZE) {
+        outbuf_flush(out);
+        if (len > OUTPUT_BUFFER_SIZE) {
+            outbuf_raw_write(out, data, len);
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+int outbuf_close(OutBuf* out) {
+    if (out->fd < 0) return 0;
+    
+    outbuf_flush(out);
+    int ok = !out->failed && close(out->fd) == 0;
+    free(out->buf);
+    out->buf = NULL;
+    out->fd = -1;
+    return ok;
+}
+
+// Same digits as printf("%.2f") without the printf: the exact product t * 100
+// is rebuilt with a Dekker split so ties round half-to-even on the real value.
+size_t format_time(char* out, double t) {
+    if (!(t >= 0 && t < 1e15)) {
+        return snprintf(out, 32, "%.2f", t);
+    }
+    
+    double p = t * 100.0;
+    double split = t * 134217729.0;
+    double hi = split - (split - t);
+    double lo = t - hi;
+    double err = (hi * 100.0 - p) + lo * 100.0;
+    
+    uint64_t n = (uint64_t)p;
+    double d = (p - (double)n) - 0.5;
+    if (d > -err || (d == -err && (n & 1))) n++;
+    
+    char digits[24];
+    size_t len = 0;
+    uint64_t whole = n / 100;
+    do {
+        digits[len++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole);
+    
+    size_t pos = 0;
+    while (len) out[pos++] = digits[--len];
+    out[pos++] = '.';
+    out[pos++] = '0' + (n % 100) / 10;
+    out[pos++] = '0' + n % 10;
+    return pos;
+}
+
+// Writes song.txt and sheetConversion.txt in the same pass over the notes.
+typedef struct {
+    OutBuf song;
+    OutBuf sheet;
+    int sheet_count;
+} SongWriter;
+
+int song_writer_open(SongWriter* writer, const char* song_file, const char* sheet_file) {
+    writer->sheet_count = 0;
+    writer->sheet.fd = -1;
+    
+    if (!outbuf_open(&writer->song, song_file)) {
+        perror("Error opening song file");
+        return 0;
+    }
+    if (!outbuf_open(&writer->sheet, sheet_file)) {
+        perror("Error opening sheet file");
+        outbuf_close(&writer->song);
+        return 0;
+    }
+    
+    outbuf_write(&writer->song, "playback_speed=1.1\n", 19);
+    return 1;
+}
+
+void song_writer_note(SongWriter* writer, const MidiNote* note) {
+    size_t len = strlen(note->note);
+    
+    char line[32];
+    size_t line_len = format_time(line, note->time);
+    line[line_len++] = ' ';
+    outbuf_write(&writer->song, line, line_len);
+    outbuf_write(&writer->song, note->note, len);
+    outbuf_write(&writer->song, "\n", 1);
+    
+    if (!is_press(note->note)) return;
+    
+    if (len > 1) {
+        outbuf_write(&writer->sheet, "[", 1);
+        outbuf_write(&writer->sheet, note->note, len);
+        outbuf_write(&writer->sheet, "] ", 2);
+    } else {
+        outbuf_write(&writer->sheet, note->note, len);
+        outbuf_write(&writer->sheet, " ", 1);
+    }
+    
+    writer->sheet_count++;
+    
+    if (writer->sheet_count % 8 == 0) {
+        outbuf_write(&writer->sheet, "\n", 1);
+    }
+    
+    if (writer->sheet_count % 32 == 0) {
+        outbuf_write(&writer->sheet, "\n\n", 2);
+    }
+}
+
+int song_writer_close(SongWriter* writer) {
+    int ok = 1;
+    if (!outbuf_close(&writer->song)) {
+        perror("Error writing song file");
+        ok = 0;
+    }
+    if (!outbuf_close(&writer->sheet)) {
+        perror("Error writing sheet file");
+        ok = 0;
+    }
+    return ok;
+}
+
+typedef struct {
+    MidiReader* reader;
+    SongWriter writer;
+    SongSimplifier ss;
+    MidiNote last;
+    int has_last;
+} ExternalOutput;
+
+// Last note is held back one step: its time gets forced to 1.00 like the in-memory path does.
+void external_output_sink(void* ctx, MidiNote note) {
+    ExternalOutput* out = ctx;
+    
+    if (out->reader->simplify && !song_simplifier_feed(&out->ss, &note)) {
+        free(note.note);
+        return;
+    }
+    
+    if (out->has_last) {
+        song_writer_note(&out->writer, &out->last);
+        free(out->last.note);
+    }
+    
+    out->last = note;
+    out->has_last = 1;
+}
+
+void cleaner_sink(void* ctx, MidiNote note) {
+    cleaner_feed(ctx, note);
+}
+
+void process_midi_file_external(MidiReader* reader, const char* record_file,
+                                const char* song_file, const char* sheet_file) {
+    reader->success = 0;
+    
+    printf("Saving processing log to %s\n", record_file);
+    reader->record_out = malloc(sizeof(OutBuf));
+    if (!reader->record_out || !outbuf_open(reader->record_out, record_file)) {
+        perror("Error opening record file");
+        free(reader->record_out);
+        reader->record_out = NULL;
+        return;
+    }
+    
+    if (!map_midi_bytes(reader)) return;
+    
+    printf("Processing %s (external memory, %zu MB budget)\n", reader->filename, reader->mem_budget >> 20);
+    
+    read_events(reader);
+    
+    printf("%u notes processed. Your MIDI survived!\n", reader->key_press_count);
+    report_left_out(reader);
+    
+    spill_run(reader);
+    free(reader->notes);
+    reader->notes = NULL;
+    reader->notes_capacity = 0;
+    
+    munmap(reader->bytes, reader->bytes_size);
+    reader->bytes = NULL;
+    reader->bytes_size = 0;
+    reader->mapped = 0;
+    
+    reduce_runs(reader);
+    
+    printf("Saving notes to %s\n", song_file);
+    printf("Saving sheets to %s\n", sheet_file);
+    
+    ExternalOutput out = {0};
+    out.reader = reader;
+    if (!song_writer_open(&out.writer, song_file, sheet_file)) {
+        return;
+    }
+    
+    if (reader->simplify) {
+        song_simplifier_init(&out.ss, reader);
+    }
+    
+    EventOptimizer* opt = calloc(1, sizeof(EventOptimizer));
+    NoteCleaner cleaner = {0};
+    
+    if (reader->optimize && opt) {
+        opt->sink = external_output_sink;
+        opt->ctx = &out;
+        cleaner.sink = optimizer_sink;
+        cleaner.ctx = opt;
+    } else {
+        cleaner.sink = external_output_sink;
+        cleaner.ctx = &out;
+    }
+    
+    merge_runs(reader->runs, reader->runs_count, cleaner_sink, &cleaner);
+    cleaner_flush(&cleaner);
+    
+    if (cleaner.sink == optimizer_sink) {
+        optimizer_flush(opt);
+        optimizer_report(opt, reader);
+    }
+    free(opt);
+    
+    if (out.has_last) {
+        out.last.time = 1.00;
+        song_writer_note(&out.writer, &out.last);
+        free(out.last.note);
+    }
+    
+    if (reader->simplify) {
+        song_simplifier_report(&out.ss, reader);
+    }
+    
+    reader->success = song_writer_close(&out.writer);
+}
+
+int save_outputs(MidiReader* reader, const char* song_file, const char* sheet_file) {
+    TRACE_SCOPE("save_outputs");
+    
+    printf("Saving notes to %s\n", song_file);
+    printf("Saving sheets to %s\n", sheet_file);
+    
+    SongWriter writer;
+    if (!song_writer_open(&writer, song_file, sheet_file)) {
+        return 0;
+    }
+    
+    for (size_t i = 0; i < reader->notes_count; i++) {
+        song_writer_note(&writer, &reader->notes[i]);
+    }
+    
+    return song_writer_close(&writer);
+}
+
+void save_record(MidiReader* reader, const char* record_file) {
+    TRACE_SCOPE("save_record");
+    
+    printf("Saving processing log to %s\n", record_file);
+    
+    OutBuf out;
+    if (!outbuf_open(&out, record_file)) {
+        perror("Error opening record file");
+        return;
+    }
+    
+    for (size_t i = 0; i < reader->log_count; i++) {
+        outbuf_write(&out, reader->log_entries[i], strlen(reader->log_entries[i]));
+        outbuf_write(&out, "\n", 1);
+    }
+    
+    if (!outbuf_close(&out)) {
+        perror("Error writing record file");
+    }
+}
+
+int load_midi_bytes(MidiReader* reader) {
+    TRACE_SCOPE("load");
+    
+    FILE* file = fopen(reader->filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open MIDI file %s\n", reader->filename);
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    reader->bytes_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    reader->bytes = (uint8_t*)malloc(reader->bytes_size);
+    if (!reader->bytes) {
+        fclose(file);
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    
+    size_t bytes_read = fread(reader->bytes, 1, reader->bytes_size, file);
+    fclose(file);
+    
+    if (bytes_read != reader->bytes_size) {
+        fprintf(stderr, "Error: Failed to read complete file\n");
+        free(reader->bytes);
+        reader->bytes = NULL;
+        return 0;
+    }
+    
+    return 1;
+}
+
+void report_left_out(MidiReader* reader) {
+    if (reader->skipped_tracks) {
+        printf("%u tracks skipped by --tracks\n", reader->skipped_tracks);
+    }
+    if (reader->filtered_keys) {
+        printf("%u notes outside --keys left out\n", reader->filtered_keys);
+    }
+    if (reader->dropped_keys) {
+        printf("%u notes were off the piano and got dropped\n", reader->dropped_keys);
+    }
+}
+
+void process_midi_file(MidiReader* reader, const char* record_file) {
+    if (!load_midi_bytes(reader)) {
+        reader->success = 0;
+        return;
+    }
+    
+    printf("Processing %s\n", reader->filename);
+
+    read_events(reader);
+    
+    printf("%u notes processed. Your MIDI survived!\n", reader->key_press_count);
+    report_left_out(reader);
+    
+    clean_notes(reader);
+    
+    if (reader->simplify) {
+        simplify_song(reader);
+    }
+    
+    reader->success = 1;
+
+    if (reader->success && reader->notes_count > 0) {
+        reader->notes[reader->notes_count - 1].time = 1.00;
+    }
+
+    save_record(reader, record_file);
+}
+
+// Counts every Note On in a quick first pass and picks the octave shift that
+// keeps the most of them on the piano, preferring the smallest shift. Under a
+// memory budget the scan reads a mapping, like the conversion itself.
+int choose_transpose(const char* midi_file, int fast_decode, const MidiFilter* filter, size_t mem_budget) {
+    MidiReader* scan = midi_reader_init(midi_file);
+    if (!scan || !(mem_budget ? map_midi_bytes(scan) : load_midi_bytes(scan))) {
+        midi_reader_cleanup(scan);
+        return 0;
+    }
+    
+    scan->fast_decode = fast_decode;
+    scan->mem_budget = mem_budget;
+    scan->filter = *filter;
+    scan->scan_keys = 1;
+    read_events(scan);
+    
+    int size = (int)strlen(scan->piano_scale);
+    int best = 0;
+    uint64_t best_fit = 0;
+    
+    for (int step = 0; step <= 20; step++) {
+        int octaves = (step + 1) / 2 * (step % 2 ? 1 : -1);
+        uint64_t fit = 0;
+        for (int key = 0; key < 128; key++) {
+            if (!range_list_has(&filter->keys, key)) continue;
+            int map = key + octaves * 12 - PIANO_LOW_KEY;
+            if (map >= 0 && map < size) fit += scan->key_counts[key];
+        }
+        if (fit > best_fit) {
+            best_fit = fit;
+            best = octaves;
+        }
+    }
+    
+    midi_reader_cleanup(scan);
+    return best;
+}
+
+// Decodes the file with and without the fast note kernel and diffs the raw events.
+int check_decode(const char* midi_file) {
+    MidiReader* scalar = midi_reader_init(midi_file);
+    MidiReader* fast = midi_reader_init(midi_file);
+    if (!scalar || !fast || !load_midi_bytes(scalar) || !load_midi_bytes(fast)) {
+        midi_reader_cleanup(scalar);
+        midi_reader_cleanup(fast);
         return 1;
     }
     
+    scalar->fast_decode = 0;
+    read_events(scalar);
+    read_events(fast);
+    
+    int ok = scalar->notes_count == fast->notes_count &&
+             scalar->key_press_count == fast->key_press_count;
+    size_t mismatch = 0;
+    
+    for (size_t i = 0; ok && i < scalar->notes_count; i++) {
+        if (scalar->notes[i].time != fast->notes[i].time ||
+            strcmp(scalar->notes[i].note, fast->notes[i].note) != 0) {
+            ok = 0;
+            mismatch = i;
+        }
+    }
+    
+    if (ok) {
+        printf("Decode check passed: %zu events, fast kernel matches scalar path\n", scalar->notes_count);
+    } else {
+        printf("Decode check FAILED: scalar %zu events, fast %zu events, first mismatch at %zu\n",
+               scalar->notes_count, fast->notes_count, mismatch);
+    }
+    
+    midi_reader_cleanup(scalar);
+    midi_reader_cleanup(fast);
+    return ok ? 0 : 1;
+}
+
+// Options one conversion runs with, shared by the CLI and the watch daemon.
+typedef struct {
+    int verbose;
+    int simplify;
+    SimplifyConfig simplify_cfg;
+    size_t mem_budget;
+    int fast_decode;
+    int fold;
+    int optimize;
+    MidiFilter filter;
+} ConvertOptions;
+
+// Returns 1 once the song and sheet are written.
+int convert_midi(const char* midi_file, const ConvertOptions* opts, const char* record_file,
+                 const char* song_file, const char* sheet_file) {
     MidiReader* reader = midi_reader_init(midi_file);
     if (!reader) {
         fprintf(stderr, "Error: Failed to initialize MIDI reader\n");
-        return 1;
+        return 0;
+    }
+    
+    reader->verbose = opts->verbose;
+    reader->fast_decode = opts->fast_decode;
+    reader->simplify = opts->simplify;
+    reader->simplify_cfg = opts->simplify_cfg;
+    reader->mem_budget = opts->mem_budget;
+    reader->fold = opts->fold;
+    reader->optimize = opts->optimize;
+    reader->filter = opts->filter;
+    
+    if (opts->fold == FOLD_TRANSPOSE) {
+        reader->transpose = choose_transpose(midi_file, opts->fast_decode, &opts->filter, opts->mem_budget);
+        printf("Transposing by %d octave(s) to fit the piano\n", reader->transpose);
+    }
+    build_key_map(reader);
+    
+    int ok = 0;
+    if (reader->mem_budget) {
+        process_midi_file_external(reader, record_file, song_file, sheet_file);
+        ok = reader->success;
+    } else {
+        process_midi_file(reader, record_file);
+        ok = reader->success && save_outputs(reader, song_file, sheet_file);
+    }
+    
+    midi_reader_cleanup(reader);
+    return ok;
+}
+
+// Watch-folder mode: inotify on a drop directory, a short settle time so we
+// don't read half-copied files, and a fixed pool of worker threads that write
+// into the library under temp names and rename() into place. play_core can
+// load library/<name>.txt at any time and never sees a partial song.
+#define WATCH_SETTLE_SECONDS 0.5
+#define WATCH_MAX_WORKERS 64
+
+typedef struct {
+    char* name;
+    double due;
+    off_t size;
+    time_t mtime;
+} WatchPending;
+
+// A file a worker is converting right now. If it changes meanwhile it is
+// marked dirty and queued again once that conversion is done.
+typedef struct {
+    char* name;
+    int dirty;
+} WatchActive;
+
+typedef struct {
+    const char* drop_dir;
+    const char* library_dir;
+    ConvertOptions opts;
+    
+    WatchPending* pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char** jobs;
+    size_t jobs_head;
+    size_t jobs_count;
+    size_t jobs_capacity;
+    WatchActive* active;
+    size_t active_count;
+    size_t active_capacity;
+    size_t converted;
+    size_t failed;
+} Watcher;
+
+double watch_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int is_midi_name(const char* name) {
+    size_t len = strlen(name);
+    return name[0] != '.' && len > 4 &&
+           (strcmp(name + len - 4, ".mid") == 0 || strcmp(name + len - 4, ".MID") == 0);
+}
+
+// Restarts the settle timer for a file that just changed.
+void watch_touch(Watcher* w, const char* name) {
+    double due = watch_now() + WATCH_SETTLE_SECONDS;
+    
+    for (size_t i = 0; i < w->pending_count; i++) {
+        if (strcmp(w->pending[i].name, name) == 0) {
+            w->pending[i].due = due;
+            return;
+        }
+    }
+    
+    if (w->pending_count >= w->pending_capacity) {
+        w->pending_capacity = w->pending_capacity ? w->pending_capacity * 2 : 64;
+        w->pending = realloc(w->pending, sizeof(WatchPending) * w->pending_capacity);
+    }
+    w->pending[w->pending_count++] = (WatchPending){strdup(name), due, -1, 0};
+}
+
+// Call with w->lock held.
+void watch_push(Watcher* w, char* name) {
+    if (w->jobs_count == w->jobs_capacity) {
+        size_t capacity = w->jobs_capacity ? w->jobs_capacity * 2 : 64;
+        char** grown = malloc(sizeof(char*) * capacity);
+        for (size_t i = 0; i < w->jobs_count; i++) {
+            grown[i] = w->jobs[(w->jobs_head + i) % w->jobs_capacity];
+        }
+        free(w->jobs);
+        w->jobs = grown;
+        w->jobs_head = 0;
+        w->jobs_capacity = capacity;
+    }
+    
+    w->jobs[(w->jobs_head + w->jobs_count++) % w->jobs_capacity] = name;
+    pthread_cond_signal(&w->ready);
+}
+
+// Queues a job unless the same file is already waiting for a worker. A file
+// being converted right now is only marked dirty, so two workers never
+// convert the same file at once.
+void watch_queue(Watcher* w, char* name) {
+    pthread_mutex_lock(&w->lock);
+    
+    for (size_t i = 0; i < w->active_count; i++) {
+        if (strcmp(w->active[i].name, name) == 0) {
+            w->active[i].dirty = 1;
+            pthread_mutex_unlock(&w->lock);
+            free(name);
+            return;
+        }
+    }
+    
+    for (size_t i = 0; i < w->jobs_count; i++) {
+        if (strcmp(w->jobs[(w->jobs_head + i) % w->jobs_capacity], name) == 0) {
+            pthread_mutex_unlock(&w->lock);
+            free(name);
+            return;
+        }
+    }
+    
+    watch_push(w, name);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Hands settled files to the workers. A file whose size or mtime still moves
+// gets another settle period. Returns ms until the next check, -1 for none.
+int watch_settle(Watcher* w) {
+    double now = watch_now();
+    double next = -1;
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < w->pending_count; i++) {
+        WatchPending* p = &w->pending[i];
+        
+        if (p->due <= now) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", w->drop_dir, p->name);
+            
+            struct stat st;
+            if (stat(path, &st) != 0) {
+                free(p->name);
+                continue;
+            }
+            if (st.st_size != p->size || st.st_mtime != p->mtime) {
+                p->size = st.st_size;
+                p->mtime = st.st_mtime;
+                p->due = now + WATCH_SETTLE_SECONDS;
+            } else {
+                watch_queue(w, p->name);
+                continue;
+            }
+        }
+        
+        if (next < 0 || p->due < next) next = p->due;
+        w->pending[kept++] = *p;
+    }
+    
+    w->pending_count = kept;
+    return next < 0 ? -1 : (int)((next - now) * 1000) + 1;
+}
+
+// Creates a fresh temp file next to `final`, so concurrent writers never share one.
+int watch_temp(char* path, size_t size, const char* dir, const char* base, const char* suffix) {
+    snprintf(path, size, "%s/.%s%s.part.XXXXXX", dir, base, suffix);
+    
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("Error creating temp file");
+        return 0;
+    }
+    fchmod(fd, 0644);
+    close(fd);
+    return 1;
+}
+
+int watch_publish(const char* tmp, const char* final) {
+    if (rename(tmp, final) == 0) return 1;
+    perror("Error publishing converted song");
+    unlink(tmp);
+    return 0;
+}
+
+void watch_convert(Watcher* w, const char* name) {
+    char midi_path[PATH_MAX], base[NAME_MAX + 1];
+    snprintf(midi_path, sizeof(midi_path), "%s/%s", w->drop_dir, name);
+    snprintf(base, sizeof(base), "%.*s", (int)strlen(name) - 4, name);
+    
+    char song[PATH_MAX], sheet[PATH_MAX], song_tmp[PATH_MAX], sheet_tmp[PATH_MAX];
+    snprintf(song, sizeof(song), "%s/%s.txt", w->library_dir, base);
+    snprintf(sheet, sizeof(sheet), "%s/%s.sheet.txt", w->library_dir, base);
+    song_tmp[0] = sheet_tmp[0] = '\0';
+    
+    double start = watch_now();
+    int ok = watch_temp(song_tmp, sizeof(song_tmp), w->library_dir, base, ".txt") &&
+             watch_temp(sheet_tmp, sizeof(sheet_tmp), w->library_dir, base, ".sheet.txt") &&
+             convert_midi(midi_path, &w->opts, "/dev/null", song_tmp, sheet_tmp);
+    
+    // Sheet first, so whoever sees the new song also finds its sheet.
+    ok = ok && watch_publish(sheet_tmp, sheet) && watch_publish(song_tmp, song);
+    if (!ok) {
+        if (song_tmp[0]) unlink(song_tmp);
+        if (sheet_tmp[0]) unlink(sheet_tmp);
+    }
+    
+    pthread_mutex_lock(&w->lock);
+    if (ok) w->converted++;
+    else w->failed++;
+    pthread_mutex_unlock(&w->lock);
+    
+    if (ok) {
+        printf("Converted %s -> %s in %.2fs\n", name, song, watch_now() - start);
+    } else {
+        fprintf(stderr, "Failed to convert %s\n", name);
+    }
+}
+
+void* watch_worker(void* arg) {
+    Watcher* w = arg;
+    
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        while (w->jobs_count == 0) pthread_cond_wait(&w->ready, &w->lock);
+        char* name = w->jobs[w->jobs_head];
+        w->jobs_head = (w->jobs_head + 1) % w->jobs_capacity;
+        w->jobs_count--;
+        
+        if (w->active_count == w->active_capacity) {
+            w->active_capacity = w->active_capacity ? w->active_capacity * 2 : 16;
+            w->active = realloc(w->active, sizeof(WatchActive) * w->active_capacity);
+        }
+        w->active[w->active_count++] = (WatchActive){name, 0};
+        pthread_mutex_unlock(&w->lock);
+        
+        watch_convert(w, name);
+        
+        pthread_mutex_lock(&w->lock);
+        int dirty = 0;
+        for (size_t i = 0; i < w->active_count; i++) {
+            if (w->active[i].name == name) {
+                dirty = w->active[i].dirty;
+                w->active[i] = w->active[--w->active_count];
+                break;
+            }
+        }
+        if (dirty) {
+            watch_push(w, name);
+        } else {
+            free(name);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    
+    return NULL;
+}
+
+// Queues every MIDI in the drop folder whose song is missing or older, and
+// clears out temp files a killed run left in the library.
+void watch_scan(Watcher* w) {
+    DIR* dir = opendir(w->library_dir);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.' && strstr(entry->d_name, ".part.")) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", w->library_dir, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
     }
+    
+    dir = opendir(w->drop_dir);
+    if (!dir) return;
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (!is_midi_name(entry->d_name)) continue;
+        
+        char midi_path[PATH_MAX], song[PATH_MAX];
+        snprintf(midi_path, sizeof(midi_path), "%s/%s", w->drop_dir, entry->d_name);
+        snprintf(song, sizeof(song), "%s/%.*s.txt", w->library_dir,
+                 (int)strlen(entry->d_name) - 4, entry->d_name);
+        
+        struct stat midi_st, song_st;
+        if (stat(midi_path, &midi_st) != 0 || !S_ISREG(midi_st.st_mode)) continue;
+        if (stat(song, &song_st) == 0 && song_st.st_mtime >= midi_st.st_mtime) continue;
+        
+        watch_queue(w, strdup(entry->d_name));
+    }
+    closedir(dir);
+}
 
-    reader->verbose = 1;
+int run_watcher(const char* drop_dir, const char* library_dir, int workers, const ConvertOptions* opts) {
+    if (mkdir(library_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating library directory");
+        return 1;
+    }
+    
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, drop_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY) < 0) {
+        perror("Error watching drop directory");
+        return 1;
+    }
+    
+    Watcher w = {0};
+    w.drop_dir = drop_dir;
+    w.library_dir = library_dir;
+    w.opts = *opts;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.ready, NULL);
+    
+    if (workers < 1) workers = 1;
+    if (workers > WATCH_MAX_WORKERS) workers = WATCH_MAX_WORKERS;
+    
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, watch_worker, &w) != 0) {
+            perror("Error starting worker");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Watching %s, converting into %s with %d worker(s)\n", drop_dir, library_dir, workers);
+    watch_scan(&w);
+    
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int timeout = -1;
     
-    process_midi_file(reader, "midiRecord.txt");
+    while (1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) break;
+        
+        if (ready > 0) {
+            ssize_t got = read(fd, buf, sizeof(buf));
+            for (char* p = buf; got > 0 && p < buf + got; ) {
+                struct inotify_event* event = (struct inotify_event*)p;
+                if (event->len && is_midi_name(event->name)) watch_touch(&w, event->name);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        
+        timeout = watch_settle(&w);
+    }
     
-    if (reader->success) {
-        save_song(reader, "song.txt");
-        save_sheet(reader, "sheetConversion.txt");
+    close(fd);
+    return 1;
+}
+
+void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options] <midi_file>\n", prog);
+    fprintf(stderr, "       %s [options] --watch DIR [--library DIR] [--workers N]\n", prog);
+    fprintf(stderr, "  --verbose         print every decoded event and log it to midiRecord.txt\n");
+    fprintf(stderr, "  --simplify        trim chords and fast runs down to something playable\n");
+    fprintf(stderr, "  --max-chord N     keys per chord when simplifying (default 6)\n");
+    fprintf(stderr, "  --max-eps N       key events per second when simplifying (default 120)\n");
+    fprintf(stderr, "  --max-span N      semitones one hand can reach when simplifying (default 12)\n");
+    fprintf(stderr, "  --mem-budget MB   bounded-memory conversion: spill sorted runs to disk past MB megabytes\n");
+    fprintf(stderr, "  --fold MODE       notes off the piano: wrap (default), clamp, drop or transpose\n");
+    fprintf(stderr, "  --no-optimize     keep orphan releases and repeated tempo events\n");
+    fprintf(stderr, "  --tracks LIST     only convert these tracks, counted from 1 (e.g. 2-4,7)\n");
+    fprintf(stderr, "  --channels LIST   only convert these channels, 1-16 (e.g. 1-9,11-16)\n");
+    fprintf(stderr, "  --no-drums        leave out channel 10\n");
+    fprintf(stderr, "  --keys LIST       only convert these MIDI note numbers (e.g. 36-96)\n");
+    fprintf(stderr, "  --trace FILE      write a Chrome trace of the conversion (build with -DTRACE)\n");
+    fprintf(stderr, "  --no-fast-decode  decode every note event through the scalar path\n");
+    fprintf(stderr, "  --check-decode    decode with and without the fast kernel, compare, and exit\n");
+    fprintf(stderr, "  --watch DIR       keep running and convert every .mid dropped into DIR\n");
+    fprintf(stderr, "  --library DIR     where --watch puts NAME.txt and NAME.sheet.txt (default library)\n");
+    fprintf(stderr, "  --workers N       conversions running at once in --watch mode (default 2)\n");
+}
+
+#ifdef MIDI_FUZZ
+// Fuzz target: each input is parsed, cleaned and simplified in memory.
+//   clang -g -O1 -fsanitize=fuzzer,address,undefined -DMIDI_FUZZ -o midi_fuzz midi_core.c -lpthread
+//   ./midi_fuzz -timeout=2 -close_fd_mask=1 fuzz/corpus
+// With -DMIDI_FUZZ_MAIN instead of -fsanitize=fuzzer you get a plain driver
+// that runs every file it's given, for AFL or a regression pass over the corpus:
+//   gcc -g -fsanitize=address,undefined -DMIDI_FUZZ -DMIDI_FUZZ_MAIN -o midi_fuzz midi_core.c -lpthread
+//   ./midi_fuzz fuzz/corpus/*
+//   afl-fuzz -i fuzz/corpus -o findings -- ./midi_fuzz @@
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    MidiReader* reader = midi_reader_init("fuzz.mid");
+    if (!reader) return 0;
+    
+    // An exact-size copy, so the sanitizer sees any read past the end.
+    reader->bytes = malloc(size ? size : 1);
+    if (!reader->bytes) {
+        midi_reader_cleanup(reader);
+        return 0;
     }
+    memcpy(reader->bytes, data, size);
+    reader->bytes_size = size;
+    
+    // The last byte (usually the end-of-track 0) picks the options, so one
+    // corpus covers both decode paths, the fold modes and the filters.
+    uint8_t pick = size ? data[size - 1] : 0;
+    reader->fast_decode = !(pick & 1);
+    reader->fold = (pick >> 1) & 3;
+    reader->simplify = (pick >> 3) & 1;
+    if (pick & 0x10) reader->filter.channels &= ~(1 << 9);
+    if (pick & 0x20) range_list_parse(&reader->filter.tracks, "2-3");
+    if (pick & 0x40) range_list_parse(&reader->filter.keys, "48-84");
+    build_key_map(reader);
+    
+    read_events(reader);
+    clean_notes(reader);
+    if (reader->simplify) simplify_song(reader);
     
     midi_reader_cleanup(reader);
+    return 0;
+}
+
+#ifdef MIDI_FUZZ_MAIN
+#define FUZZ_TIME_LIMIT 2
+
+char fuzzMessage[PATH_MAX + 32];
+
+void fuzz_timeout(int sig) {
+    (void)sig;
+    ssize_t written = write(2, fuzzMessage, strlen(fuzzMessage));
+    (void)written;
+    abort();
+}
+
+// Runs each file once; a crash, sanitizer report or an input that takes over
+// FUZZ_TIME_LIMIT seconds ends the run with a failure.
+int main(int argc, char* argv[]) {
+    signal(SIGALRM, fuzz_timeout);
+    
+    for (int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "rb");
+        if (!file) {
+            fprintf(stderr, "Error: Could not open %s\n", argv[i]);
+            return 1;
+        }
+        
+        uint8_t* data = NULL;
+        size_t size = 0, capacity = 0;
+        while (1) {
+            if (size == capacity) {
+                capacity = capacity ? capacity * 2 : 65536;
+                uint8_t* grown = realloc(data, capacity);
+                if (!grown) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    return 1;
+                }
+                data = grown;
+            }
+            size_t got = fread(data + size, 1, capacity - size, file);
+            if (got == 0) break;
+            size += got;
+        }
+        fclose(file);
+        
+        snprintf(fuzzMessage, sizeof(fuzzMessage), "Timed out on %s\n", argv[i]);
+        alarm(FUZZ_TIME_LIMIT);
+        LLVMFuzzerTestOneInput(data, size);
+        alarm(0);
+        free(data);
+    }
+    
+    printf("%d inputs ok\n", argc - 1);
+    return 0;
+}
+#endif
+
+#else
+
+int main(int argc, char* argv[]) {
+    const char* midi_file = NULL;
+    int verbose = 0;
+    int simplify = 0;
+    SimplifyConfig simplify_cfg = {6, 120, 12};
+    size_t mem_budget = 0;
+    int fast_decode = 1;
+    int check = 0;
+    int fold = FOLD_WRAP;
+    int optimize = 1;
+    const char* trace_file = NULL;
+    const char* watch_dir = NULL;
+    const char* library_dir = "library";
+    int workers = 2;
+    MidiFilter filter = {{0}, 0xFFFF, {0}};
+    int no_drums = 0;
+    RangeList channels;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--simplify") == 0) {
+            simplify = 1;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "--max-chord") == 0 && i + 1 < argc) {
+            simplify_cfg.max_chord_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-eps") == 0 && i + 1 < argc) {
+            simplify_cfg.max_events_per_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-span") == 0 && i + 1 < argc) {
+            simplify_cfg.max_span = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+            mem_budget = strtoull(argv[++i], NULL, 10) << 20;
+            if (mem_budget == 0) mem_budget = 1 << 20;
+        } else if (strcmp(argv[i], "--fold") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "wrap") == 0) fold = FOLD_WRAP;
+            else if (strcmp(argv[i], "clamp") == 0) fold = FOLD_CLAMP;
+            else if (strcmp(argv[i], "drop") == 0) fold = FOLD_DROP;
+            else if (strcmp(argv[i], "transpose") == 0) fold = FOLD_TRANSPOSE;
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--no-optimize") == 0) {
+            optimize = 0;
+        } else if (strcmp(argv[i], "--tracks") == 0 && i + 1 < argc) {
+            if (!range_list_parse(&filter.tracks, argv[++i])) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc) {
+            if (!range_list_parse(&channels, argv[++i])) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            filter.channels = 0;
+            for (int channel = 1; channel <= 16; channel++) {
+                if (range_list_has(&channels, channel)) filter.channels |= 1 << (channel - 1);
+            }
+        } else if (strcmp(argv[i], "--no-drums") == 0) {
+            no_drums = 1;
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            if (!range_list_parse(&filter.keys, argv[++i])) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-fast-decode") == 0) {
+            fast_decode = 0;
+        } else if (strcmp(argv[i], "--check-decode") == 0) {
+            check = 1;
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch_dir = argv[++i];
+        } else if (strcmp(argv[i], "--library") == 0 && i + 1 < argc) {
+            library_dir = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            midi_file = argv[i];
+        }
+    }
+    
+    if (no_drums) filter.channels &= ~(1 << 9);
+    
+    ConvertOptions opts = {verbose, simplify, simplify_cfg, mem_budget, fast_decode, fold, optimize, filter};
+    
+    if (watch_dir) {
+        opts.verbose = 0;
+        return run_watcher(watch_dir, library_dir, workers, &opts);
+    }
+    
+    if (!midi_file) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    if (!strstr(midi_file, ".mid") && !strstr(midi_file, ".MID")) {
+        fprintf(stderr, "Error: File must have .mid extension\n");
+        return 1;
+    }
+    
+    if (check) {
+        return check_decode(midi_file);
+    }
+    
+    convert_midi(midi_file, &opts, "midiRecord.txt", "song.txt", "sheetConversion.txt");
+    
+    if (trace_file && trace_export(trace_file)) {
+        printf("Saved trace to %s\n", trace_file);
+    }
     
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
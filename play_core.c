@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,34 +7,80 @@
 #include <pthread.h>
 #include <ctype.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sched.h>
+#include <limits.h>
+#include <errno.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
+#include <X11/XKBlib.h>
 #include <X11/extensions/XTest.h>
 
+#include "simplify.h"
+#include "telemetry.h"
+#include "trace.h"
+
 atomic_bool isPlaying = false;
 atomic_bool legitModeActive = false;
 atomic_int storedIndex = 0;
-atomic_double elapsedTime = 0;
+_Atomic double elapsedTime = 0;
 double origionalPlaybackSpeed = 1.0;
 double speedMultiplier = 2.0;
 double playback_speed = 1.0;
 
+const char* pianoScale = "1!2@34$5%6^78*9(0qQwWeErtTyYuiIoOpPasSdDfgGhHjJklLzZxcCvVbBnm";
+bool simplifyEnabled = true;
+SimplifyConfig simplifyConfig = {6, 120, 12};
+uint64_t legitSeed = 0;
+bool streamMode = false;
+const char* songPath = "song.txt";
+const char* traceFile = NULL;
+
+#define MAX_EVENT_KEYS 32
+
+// One playable event, resolved by compile_events() so the player never touches the string.
 typedef struct {
     double delay;
     char* notes;
-} NoteInfo;
+    float complexity;
+    uint32_t shift_mask;
+    uint8_t key_count;
+    uint8_t release;
+    KeyCode keycodes[MAX_EVENT_KEYS];
+} __attribute__((aligned(64))) NoteInfo;
+
+typedef struct {
+    double delay;
+    double chord_gap;
+} HumanTiming;
 
 typedef struct {
     double tempo;
     double tOffset;
     NoteInfo* notes;
     size_t notes_count;
+    HumanTiming* human;
+    double total_duration;
+    char* pool;
+    size_t pool_size;
 } SongInfo;
 
 SongInfo* infoTuple = NULL;
 
 typedef struct {
-    char key;
+    KeyCode keycode;
     double hold_until;
 } HeldNote;
 
@@ -43,117 +90,298 @@ size_t heldNotes_capacity = 0;
 
 Display* display = NULL;
 
-void init_keyboard() {
-    display = XOpenDisplay(NULL);
-    if (!display) {
-        fprintf(stderr, "Cannot open X display\n");
-        exit(1);
-    }
+KeyCode shiftKeycode = 0;
+
+bool telemetryEnabled = true;
+TelemetryBlock* telemetry = NULL;
+TelemetryStats liveStats;
+atomic_flag telemetryBusy = ATOMIC_FLAG_INIT;
+char telemetryName[64];
+
+double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void press_key(KeySym keysym) {
-    if (!display) return;
+void flush_display() {
+    TRACE_SCOPE("flush");
+    
+    double start = monotonic_seconds();
+    XFlush(display);
     
-    KeyCode keycode = XKeysymToKeycode(display, keysym);
-    if (keycode) {
-        XTestFakeKeyEvent(display, keycode, True, 0);
-        XFlush(display);
+    liveStats.flush_latency = monotonic_seconds() - start;
+    if (liveStats.flush_latency > liveStats.max_flush_latency) {
+        liveStats.max_flush_latency = liveStats.flush_latency;
     }
 }
 
-void release_key(KeySym keysym) {
-    if (!display) return;
+#define MAX_TARGETS 64
+#define TARGET_RING_SIZE 4096
+#define TARGET_SPIN_SECONDS 0.002
+
+typedef struct {
+    KeyCode keycode;
+    uint8_t press;
+    uint16_t delay;     // ms the X server holds it back, see --lookahead
+} KeyAction;
+
+// One X display we play into with --target. The main loop fans key
+// actions out to every target's ring; the target's injector thread, pinned to
+// its own core, turns them into XTest events and flushes when the ring runs dry.
+typedef struct {
+    const char* name;
+    Display* dpy;
+    KeyCode remap[256];
+    pthread_t thread;
+    int cpu;
+    int wake;
+    atomic_bool sleeping;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    KeyAction ring[TARGET_RING_SIZE];
+} Target;
+
+const char* targetNames[MAX_TARGETS];
+Target* targets = NULL;
+size_t targetCount = 0;
+atomic_bool targetsStop = false;
+pthread_barrier_t targetsReady;
+
+void* injectorThread(void* arg) {
+    Target* target = arg;
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(target->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    
+    pthread_barrier_wait(&targetsReady);
+    
+    double idle_since = monotonic_seconds();
+    
+    while (1) {
+        size_t tail = atomic_load_explicit(&target->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&target->head, memory_order_acquire);
+        
+        if (tail != head) {
+            TRACE_BEGIN(send);
+            for (; tail != head; tail++) {
+                KeyAction action = target->ring[tail % TARGET_RING_SIZE];
+                XTestFakeKeyEvent(target->dpy, target->remap[action.keycode], action.press, action.delay);
+            }
+            atomic_store_explicit(&target->tail, tail, memory_order_release);
+            TRACE_END(send, "inject");
+            
+            TRACE_BEGIN(flush);
+            XFlush(target->dpy);
+            TRACE_END(flush, "flush");
+            idle_since = monotonic_seconds();
+            continue;
+        }
+        
+        if (targetsStop) break;
+        if (monotonic_seconds() - idle_since < TARGET_SPIN_SECONDS) continue;
+        
+        atomic_store(&target->sleeping, true);
+        if (atomic_load(&target->head) == tail && !targetsStop) {
+            uint64_t count;
+            if (read(target->wake, &count, sizeof(count)) < 0) count = 0;
+        }
+        atomic_store(&target->sleeping, false);
+        idle_since = monotonic_seconds();
+    }
     
-    KeyCode keycode = XKeysymToKeycode(display, keysym);
-    if (keycode) {
-        XTestFakeKeyEvent(display, keycode, False, 0);
-        XFlush(display);
+    return NULL;
+}
+
+void target_wake(Target* target) {
+    uint64_t one = 1;
+    if (write(target->wake, &one, sizeof(one)) < 0) {
+        // Saturated counter, it's awake anyway.
     }
 }
 
-void press_letter(char strLetter) {
-    KeySym keysym;
-    
-    if (isupper(strLetter) || ispunct(strLetter)) {
-        keysym = XStringToKeysym(&strLetter);
-        if (keysym == NoSymbol) {
-            if (strLetter == '!') keysym = XK_exclam;
-            else if (strLetter == '@') keysym = XK_at;
-            else if (strLetter == '#') keysym = XK_numbersign;
-            else if (strLetter == '$') keysym = XK_dollar;
-            else if (strLetter == '%') keysym = XK_percent;
-            else if (strLetter == '^') keysym = XK_asciicircum;
-            else if (strLetter == '&') keysym = XK_ampersand;
-            else if (strLetter == '*') keysym = XK_asterisk;
-            else if (strLetter == '(') keysym = XK_parenleft;
-            else if (strLetter == ')') keysym = XK_parenright;
-            else keysym = XStringToKeysym(&strLetter);
-        }
+void targets_send(KeyCode keycode, int press, unsigned long delay) {
+    for (size_t i = 0; i < targetCount; i++) {
+        Target* target = &targets[i];
+        size_t head = atomic_load_explicit(&target->head, memory_order_relaxed);
         
-        press_key(XK_Shift_L);
-        press_key(keysym);
-        release_key(keysym);
-        release_key(XK_Shift_L);
-    } else {
-        keysym = XStringToKeysym(&strLetter);
-        if (keysym == NoSymbol) {
-            if (isdigit(strLetter)) {
-                keysym = XK_0 + (strLetter - '0');
-            } else {
-                keysym = XK_a + (tolower(strLetter) - 'a');
-            }
+        while (head - atomic_load_explicit(&target->tail, memory_order_acquire) >= TARGET_RING_SIZE) {
+            sched_yield();
         }
         
-        press_key(keysym);
-        release_key(keysym);
+        target->ring[head % TARGET_RING_SIZE] = (KeyAction){keycode, (uint8_t)press, (uint16_t)delay};
+        atomic_store(&target->head, head + 1);
+        if (atomic_load(&target->sleeping)) target_wake(target);
+    }
+}
+
+// Gets every injector spinning so the first notes land on all targets together.
+void targets_prime() {
+    for (size_t i = 0; i < targetCount; i++) {
+        target_wake(&targets[i]);
     }
 }
 
-void release_letter(char strLetter) {
-    KeySym keysym;
+// Opens every target, maps our keycodes onto its keymap and starts the
+// injectors. Returns once they are all pinned and waiting.
+int targets_open() {
+    targets = calloc(targetCount, sizeof(Target));
+    if (!targets) return 0;
     
-    if (isupper(strLetter) || ispunct(strLetter)) {
-        keysym = XStringToKeysym(&strLetter);
-        if (keysym == NoSymbol) {
-            if (strLetter == '!') keysym = XK_exclam;
-            else if (strLetter == '@') keysym = XK_at;
-            else if (strLetter == '#') keysym = XK_numbersign;
-            else if (strLetter == '$') keysym = XK_dollar;
-            else if (strLetter == '%') keysym = XK_percent;
-            else if (strLetter == '^') keysym = XK_asciicircum;
-            else if (strLetter == '&') keysym = XK_ampersand;
-            else if (strLetter == '*') keysym = XK_asterisk;
-            else if (strLetter == '(') keysym = XK_parenleft;
-            else if (strLetter == ')') keysym = XK_parenright;
-            else keysym = XStringToKeysym(&strLetter);
-        }
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    
+    for (size_t i = 0; i < targetCount; i++) {
+        Target* target = &targets[i];
+        target->name = targetNames[i];
+        target->dpy = XOpenDisplay(target->name);
+        target->wake = eventfd(0, EFD_CLOEXEC);
+        target->cpu = (i + 1) % cpu_count;
         
-        release_key(keysym);
-    } else {
-        keysym = XStringToKeysym(&strLetter);
-        if (keysym == NoSymbol) {
-            if (isdigit(strLetter)) {
-                keysym = XK_0 + (strLetter - '0');
-            } else {
-                keysym = XK_a + (tolower(strLetter) - 'a');
-            }
+        if (!target->dpy || target->wake < 0) {
+            fprintf(stderr, "Cannot open target display %s\n", target->name);
+            return 0;
         }
         
-        release_key(keysym);
+        for (int keycode = 0; keycode < 256; keycode++) {
+            KeySym keysym = keycode >= 8 ? XkbKeycodeToKeysym(display, keycode, 0, 0) : NoSymbol;
+            KeyCode mapped = keysym != NoSymbol ? XKeysymToKeycode(target->dpy, keysym) : 0;
+            target->remap[keycode] = mapped ? mapped : keycode;
+        }
+    }
+    
+    pthread_barrier_init(&targetsReady, NULL, targetCount + 1);
+    for (size_t i = 0; i < targetCount; i++) {
+        pthread_create(&targets[i].thread, NULL, injectorThread, &targets[i]);
     }
+    pthread_barrier_wait(&targetsReady);
+    
+    printf("Playing into %zu displays\n", targetCount);
+    return 1;
 }
 
-double calculateTotalDuration(NoteInfo* notes, size_t count) {
-    double total = 0;
-    for (size_t i = 0; i < count; i++) {
-        total += notes[i].delay;
+void targets_close() {
+    if (!targets) return;
+    
+    targetsStop = true;
+    for (size_t i = 0; i < targetCount; i++) {
+        target_wake(&targets[i]);
+        pthread_join(targets[i].thread, NULL);
+        XCloseDisplay(targets[i].dpy);
+        close(targets[i].wake);
+    }
+    
+    free(targets);
+    targets = NULL;
+}
+
+// With --target, keycodes get resolved against the first target; otherwise
+// against $DISPLAY like before.
+void init_keyboard() {
+    display = XOpenDisplay(targetCount ? targetNames[0] : NULL);
+    if (!display) {
+        fprintf(stderr, "Cannot open X display\n");
+        exit(1);
+    }
+    
+    shiftKeycode = XKeysymToKeycode(display, XK_Shift_L);
+    
+    if (targetCount && !targets_open()) {
+        exit(1);
+    }
+}
+
+// Look-ahead mode (--lookahead MS) sends events up to MS early and lets the X
+// server hold each one back by its gap to the one before, so client wake-up
+// jitter stays off the critical path. The server works through one client's
+// requests in order, so lookaheadCursor tracks where its timeline will be once
+// it has played what we sent. injectDue is when the next key event should land.
+double lookAhead = 0;
+double lookaheadCursor = 0;
+double injectDue = 0;
+
+void inject_at(double due) {
+    if (lookAhead > 0) injectDue = due;
+}
+
+// Milliseconds to hold the next key event back; the rest of a chord goes at 0.
+unsigned long server_delay() {
+    if (injectDue <= 0) return 0;
+    
+    double now = monotonic_seconds();
+    if (lookaheadCursor < now) lookaheadCursor = now;
+    
+    unsigned long ms = 0;
+    if (injectDue > lookaheadCursor) {
+        ms = (unsigned long)((injectDue - lookaheadCursor) * 1000 + 0.5);
+        if (ms > 60000) ms = 60000;
+        lookaheadCursor += ms / 1000.0;
+    }
+    injectDue = 0;
+    return ms;
+}
+
+void send_keycode(KeyCode keycode, int press) {
+    if (!keycode || (!targets && !display)) return;
+    
+    unsigned long delay = server_delay();
+    
+    if (targets) {
+        targets_send(keycode, press, delay);
+        return;
     }
-    return total;
+    
+    XTestFakeKeyEvent(display, keycode, press, delay);
+    flush_display();
+}
+
+void press_keycode(KeyCode keycode) {
+    send_keycode(keycode, True);
+}
+
+void release_keycode(KeyCode keycode) {
+    send_keycode(keycode, False);
+}
+
+KeySym letter_keysym(char strLetter) {
+    char name[2] = {strLetter, '\0'};
+    KeySym keysym = XStringToKeysym(name);
+    if (keysym != NoSymbol) return keysym;
+    
+    switch (strLetter) {
+        case '!': return XK_exclam;
+        case '@': return XK_at;
+        case '#': return XK_numbersign;
+        case '$': return XK_dollar;
+        case '%': return XK_percent;
+        case '^': return XK_asciicircum;
+        case '&': return XK_ampersand;
+        case '*': return XK_asterisk;
+        case '(': return XK_parenleft;
+        case ')': return XK_parenright;
+    }
+    
+    if (isdigit((unsigned char)strLetter)) return XK_0 + (strLetter - '0');
+    if (isalpha((unsigned char)strLetter)) return XK_a + (tolower((unsigned char)strLetter) - 'a');
+    return NoSymbol;
+}
+
+void press_event_key(const NoteInfo* note, int i) {
+    TRACE_SCOPE("send");
+    
+    int shifted = (note->shift_mask >> i) & 1;
+    
+    if (shifted) press_keycode(shiftKeycode);
+    press_keycode(note->keycodes[i]);
+    release_keycode(note->keycodes[i]);
+    if (shifted) release_keycode(shiftKeycode);
 }
 
 int isShifted(char charIn) {
-    if (isupper(charIn)) return 1;
-    if (ispunct(charIn)) return 1;
+    if (isupper((unsigned char)charIn)) return 1;
+    if (ispunct((unsigned char)charIn)) return 1;
     return 0;
 }
 
@@ -176,79 +404,159 @@ double floorToZero(double i) {
     return i > 0 ? i : 0;
 }
 
+static const double decimalPowers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a number out of [p, end). Plain decimals like "12.50" are exact
+// (integer mantissa over a power of ten); anything fancier goes to strtod.
+double parse_number(const char* p, const char* end, const char** next) {
+    const char* start = p;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    
+    while (p < end && *p >= '0' && *p <= '9') {
+        mantissa = mantissa * 10 + (*p++ - '0');
+        digits++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            digits++;
+            decimals++;
+        }
+    }
+    
+    if (digits == 0 || digits > 15 || (p < end && (*p == 'e' || *p == 'E'))) {
+        char buffer[64];
+        size_t n = end - start < 63 ? (size_t)(end - start) : 63;
+        memcpy(buffer, start, n);
+        buffer[n] = 0;
+        char* stop;
+        double value = strtod(buffer, &stop);
+        if (next) *next = start + (stop - buffer);
+        return value;
+    }
+    
+    if (next) *next = p;
+    double value = mantissa / decimalPowers[decimals];
+    return negative ? -value : value;
+}
+
+int in_pool(const SongInfo* song, const char* keys) {
+    return song->pool && keys >= song->pool && keys < song->pool + song->pool_size;
+}
+
+// Maps song.txt and parses it in place. Every key string is copied into one
+// pool sized by the file, so there is no per-line allocation and no line limit.
 SongInfo* processFile() {
-    FILE* file = fopen("song.txt", "r");
-    if (!file) {
-        printf("Couldn't open song.txt\n");
+    int fd = open(songPath, O_RDONLY);
+    if (fd < 0) {
+        printf("Couldn't open %s\n", songPath);
         return NULL;
     }
     
-    SongInfo* song = malloc(sizeof(SongInfo));
-    if (!song) {
-        fclose(file);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("First line should be playback_speed=1.0\n");
+        close(fd);
         return NULL;
     }
     
-    song->tempo = 0;
-    song->tOffset = 0;
-    song->notes = NULL;
-    song->notes_count = 0;
+    size_t size = st.st_size;
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Couldn't map %s\n", songPath);
+        return NULL;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
     
-    char line[256];
-    int tOffsetSet = 0;
-    size_t notes_capacity = 0;
+    liveStats.song_hash = telemetry_hash(data, size);
+    liveStats.song_size = size;
+    liveStats.song_mtime = st.st_mtime;
     
-    if (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "playback_speed=")) {
-            playback_speed = atof(line + 15);
-            printf("Playback speed is set to %.2fx\n", playback_speed);
-        } else {
-            printf("First line should be playback_speed=1.0\n");
-            fclose(file);
-            free(song);
-            return NULL;
+    const char* end = data + size;
+    const char* line_end = memchr(data, '\n', size);
+    if (!line_end) line_end = end;
+    
+    if (line_end - data < 15 || memcmp(data, "playback_speed=", 15) != 0) {
+        printf("First line should be playback_speed=1.0\n");
+        munmap((void*)data, size);
+        return NULL;
+    }
+    playback_speed = parse_number(data + 15, line_end, NULL);
+    printf("Playback speed is set to %.2fx\n", playback_speed);
+    
+    size_t lines = 1;
+    for (const char* p = line_end; p < end && (p = memchr(p + 1, '\n', end - p - 1)); ) {
+        lines++;
+    }
+    
+    SongInfo* song = calloc(1, sizeof(SongInfo));
+    if (song) {
+        song->notes = malloc(sizeof(NoteInfo) * lines);
+        song->pool = malloc(size + 1);
+        song->pool_size = size + 1;
+    }
+    if (!song || !song->notes || !song->pool) {
+        if (song) {
+            free(song->notes);
+            free(song->pool);
         }
+        free(song);
+        munmap((void*)data, size);
+        return NULL;
     }
     
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
+    int tOffsetSet = 0;
+    size_t pool_used = 0;
+    
+    for (const char* p = line_end + 1; p < end; p = line_end + 1) {
+        line_end = memchr(p, '\n', end - p);
+        if (!line_end) line_end = end;
         
-        if (strstr(line, "tempo=")) {
-            song->tempo = 60.0 / atof(line + 6);
-        } else {
-            char* space = strchr(line, ' ');
-            if (!space) continue;
-            
-            *space = 0;
-            double waitToPress = atof(line);
-            char* notes = space + 1;
-            
-            if (!tOffsetSet) {
-                song->tOffset = waitToPress;
-                tOffsetSet = 1;
-            }
-            
-            if (song->notes_count >= notes_capacity) {
-                notes_capacity = notes_capacity ? notes_capacity * 2 : 16;
-                song->notes = realloc(song->notes, sizeof(NoteInfo) * notes_capacity);
-                if (!song->notes) {
-                    fclose(file);
-                    free(song);
-                    return NULL;
-                }
-            }
-            
-            song->notes[song->notes_count].delay = waitToPress;
-            song->notes[song->notes_count].notes = strdup(notes);
-            song->notes_count++;
+        const char* stop = line_end;
+        if (stop > p && stop[-1] == '\r') stop--;
+        
+        const char* space = memchr(p, ' ', stop - p);
+        if (!space) continue;
+        
+        double waitToPress = parse_number(p, space, NULL);
+        const char* keys = space + 1;
+        size_t len = stop - keys;
+        
+        if (len >= 6 && memcmp(keys, "tempo=", 6) == 0) {
+            double bpm = parse_number(keys + 6, stop, NULL);
+            if (!(bpm > 0)) continue;
+            if (song->tempo == 0) song->tempo = 60.0 / bpm;
+        } else if (!tOffsetSet) {
+            song->tOffset = waitToPress;
+            tOffsetSet = 1;
         }
+        
+        char* copy = song->pool + pool_used;
+        memcpy(copy, keys, len);
+        copy[len] = 0;
+        pool_used += len + 1;
+        
+        song->notes[song->notes_count].delay = waitToPress;
+        song->notes[song->notes_count].notes = copy;
+        song->notes_count++;
     }
     
-    fclose(file);
+    munmap((void*)data, size);
     
     if (song->tempo == 0) {
         printf("No tempo found\n");
         free(song->notes);
+        free(song->pool);
         free(song);
         return NULL;
     }
@@ -256,57 +564,73 @@ SongInfo* processFile() {
     return song;
 }
 
-NoteInfo* parseInfo(SongInfo* song) {
-    if (!song || song->notes_count == 0) {
-        printf("No notes to parse\n");
-        return NULL;
+// Turns song.txt beats into seconds. A tempo line only affects the beats
+// after it, so a change sitting on a note's beat applies from that note on.
+typedef struct {
+    double seconds_per_beat;
+    double last_beat;
+    double seconds;
+} BeatClock;
+
+double beat_clock_at(BeatClock* clock, double beat) {
+    if (beat > clock->last_beat) {
+        clock->seconds += (beat - clock->last_beat) * clock->seconds_per_beat;
+        clock->last_beat = beat;
     }
+    return clock->seconds;
+}
+
+// Returns 1 if keys is a tempo line, which the clock swallows.
+int beat_clock_tempo(BeatClock* clock, const char* keys) {
+    if (strncmp(keys, "tempo=", 6) != 0) return 0;
     
-    NoteInfo* notes = malloc(sizeof(NoteInfo) * song->notes_count);
-    if (!notes) return NULL;
-    
-    memcpy(notes, song->notes, sizeof(NoteInfo) * song->notes_count);
-    size_t notes_count = song->notes_count;
+    double bpm = parse_number(keys + 6, keys + strlen(keys), NULL);
+    if (bpm > 0) clock->seconds_per_beat = 60.0 / bpm;
+    return 1;
+}
+
+// One pass over the loaded lines: tempo events are dropped in place and every
+// remaining event gets its absolute time in seconds. Returns the times array.
+double* resolve_song_times(SongInfo* song) {
+    double* times = malloc(sizeof(double) * (song->notes_count ? song->notes_count : 1));
+    if (!times) return NULL;
     
-    double tempo = song->tempo;
-    size_t i = 0;
+    BeatClock clock = {song->tempo, 0, 0};
+    size_t count = 0;
     
-    while (i < notes_count - 1) {
-        if (strstr(notes[i].notes, "tempo=")) {
-            tempo = 60.0 / atof(notes[i].notes + 6);
-            free(notes[i].notes);
-            for (size_t j = i; j < notes_count - 1; j++) {
-                notes[j] = notes[j + 1];
-            }
-            notes_count--;
-        } else {
-            notes[i].delay = (notes[i + 1].delay - notes[i].delay) * tempo;
-            i++;
-        }
+    for (size_t i = 0; i < song->notes_count; i++) {
+        double seconds = beat_clock_at(&clock, song->notes[i].delay);
+        if (beat_clock_tempo(&clock, song->notes[i].notes)) continue;
+        
+        song->notes[count] = song->notes[i];
+        times[count++] = seconds;
     }
     
-    if (notes_count > 0) {
-        notes[notes_count - 1].delay = 1.00;
+    song->notes_count = count;
+    return times;
+}
+
+// Each delay is the gap to the next event; the last one just lingers a second.
+void fill_delays(NoteInfo* notes, const double* times, size_t count) {
+    for (size_t i = 0; i + 1 < count; i++) {
+        notes[i].delay = floorToZero(times[i + 1] - times[i]);
     }
-    
-    NoteInfo* result = realloc(notes, sizeof(NoteInfo) * notes_count);
-    if (!result) {
-        free(notes);
-        return NULL;
+    if (count > 0) {
+        notes[count - 1].delay = 1.00;
     }
-    
-    return result;
 }
 
 void adjustTempoForCurrentNote() {
 }
 
-void releaseHeldNotes(const char* note_keys) {
-    for (size_t i = 0; i < strlen(note_keys); i++) {
+void releaseHeldNotes(const NoteInfo* note) {
+    TRACE_SCOPE("releaseHeldNotes");
+    
+    for (int i = 0; i < note->key_count; i++) {
         for (size_t j = 0; j < heldNotes_count; j++) {
-            if (heldNotes[j].key == note_keys[i]) {
-                release_letter(note_keys[i]);
-                heldNotes[j].key = '\0';
+            if (heldNotes[j].keycode == note->keycodes[i]) {
+                release_keycode(note->keycodes[i]);
+                heldNotes[j].keycode = 0;
                 break;
             }
         }
@@ -314,21 +638,20 @@ void releaseHeldNotes(const char* note_keys) {
     
     size_t new_count = 0;
     for (size_t i = 0; i < heldNotes_count; i++) {
-        if (heldNotes[i].key != '\0') {
+        if (heldNotes[i].keycode != 0) {
             heldNotes[new_count++] = heldNotes[i];
         }
     }
     heldNotes_count = new_count;
 }
 
-double calculate_note_complexity(const char* notes) {
-    int count = strlen(notes);
+double calculate_note_complexity(const char* notes, size_t count) {
     double complexity = count * 1.5;
     
     if (count > 3) complexity += (count - 3) * 0.7;
     
-    for (int i = 0; i < count; i++) {
-        if (isupper(notes[i]) || ispunct(notes[i])) {
+    for (size_t i = 0; i < count; i++) {
+        if (isShifted(notes[i])) {
             complexity += 0.5;
         }
     }
@@ -336,186 +659,1003 @@ double calculate_note_complexity(const char* notes) {
     return complexity;
 }
 
-void* playNextNote(void* arg) {
-    if (!isPlaying || !infoTuple || storedIndex >= infoTuple->notes_count) {
-        isPlaying = false;
-        storedIndex = 0;
-        elapsedTime = 0;
-        return NULL;
-    }
-    
-    adjustTempoForCurrentNote();
-    
-    NoteInfo noteInfo = infoTuple->notes[storedIndex];
-    double delay = floorToZero(noteInfo.delay);
-    const char* note_keys = noteInfo.notes;
-    
-    double total_duration = calculateTotalDuration(infoTuple->notes, infoTuple->notes_count);
-    
-    static double humanization_factor = 1.0;
-    static int error_count = 0;
-    static double timing_accuracy = 0.97;
+void compile_note(NoteInfo* note, const char* keys, size_t n, int release, double delay) {
+    memset(note, 0, sizeof(*note));
+    note->delay = delay;
+    note->release = release;
+    note->key_count = n;
+    note->complexity = calculate_note_complexity(keys, n);
     
-    if (legitModeActive) {
-        double complexity = calculate_note_complexity(note_keys);
-        
-        double human_delay = delay;
-        
-        if (complexity > 3.0) {
-            human_delay *= (0.95 + (rand() % 11) / 100.0);
-        }
-        
-        if (strlen(note_keys) > 1) {
-            double chord_spread = complexity * 0.005 + (rand() % 10) / 1000.0;
-            human_delay += chord_spread;
-        }
-        
-        double timing_variation = (rand() % 21 - 10) / 100.0;
-        human_delay *= (1.0 + timing_variation);
-        
-        if (complexity > 4.0 && rand() % 100 < 15) {
-            human_delay *= (0.8 + (rand() % 15) / 100.0);
-        }
-        
-        if (rand() % 200 < 5 && error_count < 2) {
-            human_delay *= 1.2;
-            error_count++;
-        }
-        
-        if (rand() % 300 < 3 && complexity < 3.0) {
-            human_delay = 0;
-        }
-        
-        delay = human_delay;
-        
-        if (rand() % 500 < 2) {
-            timing_accuracy -= 0.02;
-            if (timing_accuracy < 0.7) timing_accuracy = 0.7;
-        }
-        
-        if (rand() % 400 < 3) {
-            timing_accuracy += 0.03;
-            if (timing_accuracy > 1.05) timing_accuracy = 1.05;
-        }
-        
-        delay *= timing_accuracy;
-        
-        if (rand() % 1000 < 2) {
-            humanization_factor = 0.7 + (rand() % 6) / 10.0;
-        }
-        
-        if (rand() % 800 < 3) {
-            humanization_factor = 1.0;
-        }
-        
-        delay *= humanization_factor;
+    for (size_t j = 0; j < n; j++) {
+        note->keycodes[j] = XKeysymToKeycode(display, letter_keysym(keys[j]));
+        if (isShifted(keys[j])) note->shift_mask |= 1u << j;
     }
+}
+
+size_t event_parts(const char* keys) {
+    size_t len = strlen(keys) - (keys[0] == '~');
+    return len ? (len + MAX_EVENT_KEYS - 1) / MAX_EVENT_KEYS : 1;
+}
+
+// Compiles one MAX_EVENT_KEYS slice of keys. Only the last slice carries the delay.
+void compile_part(NoteInfo* note, char* keys, size_t part, size_t parts, double delay) {
+    int release = keys[0] == '~';
+    const char* k = keys + release;
+    const char* slice = k + part * MAX_EVENT_KEYS;
+    size_t n = strlen(slice);
+    if (n > MAX_EVENT_KEYS) n = MAX_EVENT_KEYS;
     
-    elapsedTime += delay > 0 ? delay : 0;
+    compile_note(note, slice, n, release, part == parts - 1 ? delay : 0);
     
-    if (strchr(note_keys, '~')) {
-        releaseHeldNotes(note_keys);
+    if (parts == 1) {
+        note->notes = keys;
     } else {
-        if (legitModeActive && strlen(note_keys) > 1) {
-            double complexity = calculate_note_complexity(note_keys);
-            double note_delay = complexity * 0.003 + (rand() % 10) / 1000.0;
-            
-            for (size_t i = 0; i < strlen(note_keys); i++) {
-                press_letter(note_keys[i]);
-                
-                if (heldNotes_count >= heldNotes_capacity) {
-                    heldNotes_capacity = heldNotes_capacity ? heldNotes_capacity * 2 : 16;
-                    heldNotes = realloc(heldNotes, sizeof(HeldNote) * heldNotes_capacity);
-                }
-                
-                heldNotes[heldNotes_count].key = note_keys[i];
-                heldNotes[heldNotes_count].hold_until = elapsedTime + noteInfo.delay / playback_speed;
-                heldNotes_count++;
-                
-                if (i < strlen(note_keys) - 1) {
-                    usleep(note_delay * 1000000);
-                }
-            }
-        } else {
-            for (size_t i = 0; i < strlen(note_keys); i++) {
-                press_letter(note_keys[i]);
-                
-                if (heldNotes_count >= heldNotes_capacity) {
-                    heldNotes_capacity = heldNotes_capacity ? heldNotes_capacity * 2 : 16;
-                    heldNotes = realloc(heldNotes, sizeof(HeldNote) * heldNotes_capacity);
-                }
-                
-                heldNotes[heldNotes_count].key = note_keys[i];
-                heldNotes[heldNotes_count].hold_until = elapsedTime + noteInfo.delay / playback_speed;
-                heldNotes_count++;
-            }
+        note->notes = malloc(n + 2);
+        if (note->notes) {
+            snprintf(note->notes, n + 2, "%s%.*s", release ? "~" : "", (int)n, slice);
         }
-        
-        double total_mins, total_secs, elapsed_mins, elapsed_secs;
-        total_mins = total_duration / 60;
-        total_secs = total_duration - (int)total_mins * 60;
-        elapsed_mins = elapsedTime / 60;
-        elapsed_secs = elapsedTime - (int)elapsed_mins * 60;
-        
-        printf("[%dm %ds/%dm %ds] %s\n", 
-               (int)elapsed_mins, (int)elapsed_secs,
-               (int)total_mins, (int)total_secs,
-               note_keys);
+    }
+}
+
+// Splits chords wider than MAX_EVENT_KEYS into back-to-back records.
+int compile_events(SongInfo* song) {
+    size_t total = 0;
+    for (size_t i = 0; i < song->notes_count; i++) {
+        total += event_parts(song->notes[i].notes);
     }
     
-    storedIndex++;
+    NoteInfo* compiled = calloc(total ? total : 1, sizeof(NoteInfo));
+    if (!compiled) return 0;
     
-    if (delay <= 0) {
-        playNextNote(NULL);
-    } else {
-        usleep(delay * 1000000 / playback_speed);
-        playNextNote(NULL);
+    size_t out = 0;
+    song->total_duration = 0;
+    
+    for (size_t i = 0; i < song->notes_count; i++) {
+        char* keys = song->notes[i].notes;
+        size_t parts = event_parts(keys);
+        
+        for (size_t part = 0; part < parts; part++) {
+            NoteInfo* note = &compiled[out++];
+            compile_part(note, keys, part, parts, song->notes[i].delay);
+            song->total_duration += note->delay;
+        }
     }
     
-    return NULL;
+    free(song->notes);
+    song->notes = compiled;
+    song->notes_count = out;
+    return 1;
 }
 
-void onDelPress() {
-    isPlaying = !isPlaying;
-    
-    if (isPlaying) {
-        printf("Playing...\n");
-        pthread_t thread;
-        pthread_create(&thread, NULL, playNextNote, NULL);
-        pthread_detach(thread);
-    } else {
-        printf("Stopping...\n");
-        for (size_t i = 0; i < heldNotes_count; i++) {
-            if (heldNotes[i].key != '\0') {
-                release_letter(heldNotes[i].key);
-            }
-        }
-        heldNotes_count = 0;
-    }
+// xoshiro256**, seeded through splitmix64. Same seed, same performance.
+typedef struct {
+    uint64_t s[4];
+} HumanRng;
+
+uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
 }
 
-void rewind() {
-    if (storedIndex - 10 < 0) {
-        storedIndex = 0;
-    } else {
-        storedIndex -= 10;
+void rng_seed(HumanRng* rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng->s[i] = z ^ (z >> 31);
     }
-    printf("Rewound to %d\n", storedIndex);
 }
 
-void skip() {
-    if (storedIndex + 10 > infoTuple->notes_count) {
-        isPlaying = false;
-        storedIndex = 0;
-    } else {
-        storedIndex += 10;
-    }
-    printf("Skipped to %d\n", storedIndex);
+uint64_t rng_next(HumanRng* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    
+    return result;
 }
 
-void printControls() {
-    printf("\n====================\n");
-    printf("      Controls      \n");
+int rng_below(HumanRng* rng, int n) {
+    return (int)(((rng_next(rng) >> 32) * (uint64_t)n) >> 32);
+}
+
+typedef struct {
+    HumanRng rng;
+    double humanization_factor;
+    int error_count;
+    double timing_accuracy;
+} HumanState;
+
+void human_init(HumanState* state, uint64_t seed) {
+    rng_seed(&state->rng, seed);
+    state->humanization_factor = 1.0;
+    state->error_count = 0;
+    state->timing_accuracy = 0.97;
+}
+
+// One event's worth of legit-mode dice. State carries over, so feed events in order.
+HumanTiming human_step(HumanState* state, const NoteInfo* note) {
+    TRACE_SCOPE("humanize");
+    
+    HumanRng* rng = &state->rng;
+    double complexity = note->complexity;
+    size_t key_count = note->key_count;
+    double human_delay = floorToZero(note->delay);
+    
+    if (complexity > 3.0) {
+        human_delay *= (0.95 + rng_below(rng, 11) / 100.0);
+    }
+    
+    if (key_count > 1) {
+        double chord_spread = complexity * 0.005 + rng_below(rng, 10) / 1000.0;
+        human_delay += chord_spread;
+    }
+    
+    double timing_variation = (rng_below(rng, 21) - 10) / 100.0;
+    human_delay *= (1.0 + timing_variation);
+    
+    if (complexity > 4.0 && rng_below(rng, 100) < 15) {
+        human_delay *= (0.8 + rng_below(rng, 15) / 100.0);
+    }
+    
+    if (rng_below(rng, 200) < 5 && state->error_count < 2) {
+        human_delay *= 1.2;
+        state->error_count++;
+    }
+    
+    if (rng_below(rng, 300) < 3 && complexity < 3.0) {
+        human_delay = 0;
+    }
+    
+    if (rng_below(rng, 500) < 2) {
+        state->timing_accuracy -= 0.02;
+        if (state->timing_accuracy < 0.7) state->timing_accuracy = 0.7;
+    }
+    
+    if (rng_below(rng, 400) < 3) {
+        state->timing_accuracy += 0.03;
+        if (state->timing_accuracy > 1.05) state->timing_accuracy = 1.05;
+    }
+    
+    human_delay *= state->timing_accuracy;
+    
+    if (rng_below(rng, 1000) < 2) {
+        state->humanization_factor = 0.7 + rng_below(rng, 6) / 10.0;
+    }
+    
+    if (rng_below(rng, 800) < 3) {
+        state->humanization_factor = 1.0;
+    }
+    
+    HumanTiming timing;
+    timing.delay = human_delay * state->humanization_factor;
+    timing.chord_gap = key_count > 1 ? complexity * 0.003 + rng_below(rng, 10) / 1000.0 : 0;
+    return timing;
+}
+
+// Rolls the whole legit-mode performance up front so the player only does a lookup.
+int build_human_schedule(SongInfo* song, uint64_t seed) {
+    HumanTiming* human = malloc(sizeof(HumanTiming) * (song->notes_count ? song->notes_count : 1));
+    if (!human) return 0;
+    
+    HumanState state;
+    human_init(&state, seed);
+    
+    for (size_t i = 0; i < song->notes_count; i++) {
+        human[i] = human_step(&state, &song->notes[i]);
+    }
+    
+    free(song->human);
+    song->human = human;
+    return 1;
+}
+
+#define STREAM_RING_EVENTS 4096
+#define STREAM_HISTORY 64
+#define STREAM_FIRST_WINDOW 256
+#define STREAM_RETRY_SECONDS 0.005   // player poll while the producer is behind
+
+// Bounded playback for huge songs: a producer thread decodes song.txt into a
+// fixed ring ahead of storedIndex. The last STREAM_HISTORY events stay around
+// so HOME still works without re-reading the file.
+typedef struct {
+    FILE* file;
+    pthread_t thread;
+    NoteInfo* ring;
+    HumanTiming* human;
+    atomic_size_t written;
+    atomic_bool eof;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    
+    Simplifier simplifier;
+    HumanState human_state;
+    BeatClock clock;
+    char* pending_keys;
+    double pending_time;
+} SongStream;
+
+SongStream* songStream = NULL;
+
+void stream_wait(SongStream* stream, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += ms * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    
+    pthread_mutex_lock(&stream->lock);
+    pthread_cond_timedwait(&stream->ready, &stream->lock, &ts);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void stream_push(SongStream* stream, const NoteInfo* note) {
+    size_t written = atomic_load(&stream->written);
+    
+    while (!stream->stop && written >= (size_t)storedIndex + STREAM_RING_EVENTS - STREAM_HISTORY) {
+        stream_wait(stream, 5);
+    }
+    if (stream->stop) {
+        free(note->notes);
+        return;
+    }
+    
+    size_t slot = written % STREAM_RING_EVENTS;
+    if (written >= STREAM_RING_EVENTS) {
+        free(stream->ring[slot].notes);
+    }
+    
+    stream->ring[slot] = *note;
+    stream->human[slot] = human_step(&stream->human_state, note);
+    atomic_store(&stream->written, written + 1);
+    
+    pthread_mutex_lock(&stream->lock);
+    pthread_cond_broadcast(&stream->ready);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void stream_push_keys(SongStream* stream, char* keys, double delay) {
+    size_t parts = event_parts(keys);
+    
+    for (size_t part = 0; part < parts; part++) {
+        NoteInfo note;
+        compile_part(&note, keys, part, parts, delay);
+        stream_push(stream, &note);
+    }
+    
+    if (parts > 1) free(keys);
+}
+
+// Holds one event back until the next one shows up, since the delay is the gap between them.
+void stream_emit(SongStream* stream, char* keys, double time) {
+    if (stream->pending_keys) {
+        stream_push_keys(stream, stream->pending_keys, floorToZero(time - stream->pending_time));
+    }
+    
+    stream->pending_keys = keys;
+    stream->pending_time = time;
+}
+
+void* streamProducer(void* arg) {
+    SongStream* stream = arg;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    
+    while (!stream->stop && getline(&line, &line_capacity, stream->file) >= 0) {
+        line[strcspn(line, "\n")] = 0;
+        
+        char* space = strchr(line, ' ');
+        if (!space) continue;
+        
+        *space = 0;
+        double beat = parse_number(line, space, NULL);
+        char* keys = space + 1;
+        
+        double seconds = beat_clock_at(&stream->clock, beat);
+        if (beat_clock_tempo(&stream->clock, keys)) continue;
+        
+        if (simplifyEnabled && simplifier_feed(&stream->simplifier, seconds, keys) == 0) {
+            continue;
+        }
+        
+        char* copy = strdup(keys);
+        if (copy) stream_emit(stream, copy, seconds);
+    }
+    
+    if (stream->pending_keys) {
+        stream_push_keys(stream, stream->pending_keys, 1.00);
+        stream->pending_keys = NULL;
+    }
+    
+    free(line);
+    
+    stream->eof = true;
+    pthread_mutex_lock(&stream->lock);
+    pthread_cond_broadcast(&stream->ready);
+    pthread_mutex_unlock(&stream->lock);
+    
+    return NULL;
+}
+
+SongStream* stream_open(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    
+    char line[256];
+    if (!fgets(line, sizeof(line), file) || !strstr(line, "playback_speed=")) {
+        printf("First line should be playback_speed=1.0\n");
+        fclose(file);
+        return NULL;
+    }
+    playback_speed = atof(line + 15);
+    printf("Playback speed is set to %.2fx\n", playback_speed);
+    
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        char* head = malloc(TELEMETRY_HASH_BYTES);
+        ssize_t got = head ? pread(fileno(file), head, TELEMETRY_HASH_BYTES, 0) : -1;
+        liveStats.song_hash = got > 0 ? telemetry_hash(head, got) : 0;
+        liveStats.song_size = st.st_size;
+        liveStats.song_mtime = st.st_mtime;
+        free(head);
+    }
+    
+    SongStream* stream = calloc(1, sizeof(SongStream));
+    if (!stream) {
+        fclose(file);
+        return NULL;
+    }
+    
+    stream->ring = calloc(STREAM_RING_EVENTS, sizeof(NoteInfo));
+    stream->human = calloc(STREAM_RING_EVENTS, sizeof(HumanTiming));
+    if (!stream->ring || !stream->human) {
+        free(stream->ring);
+        free(stream->human);
+        free(stream);
+        fclose(file);
+        return NULL;
+    }
+    
+    stream->file = file;
+    stream->clock.seconds_per_beat = 0.5;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->ready, NULL);
+    simplifier_init(&stream->simplifier, &simplifyConfig, pianoScale);
+    human_init(&stream->human_state, legitSeed);
+    
+    pthread_create(&stream->thread, NULL, streamProducer, stream);
+    
+    while (!stream->eof && atomic_load(&stream->written) < STREAM_FIRST_WINDOW) {
+        stream_wait(stream, 5);
+    }
+    
+    printf("Streaming %s: first %zu events ready\n", path, atomic_load(&stream->written));
+    return stream;
+}
+
+void stream_close(SongStream* stream) {
+    if (!stream) return;
+    
+    stream->stop = true;
+    pthread_join(stream->thread, NULL);
+    
+    size_t written = atomic_load(&stream->written);
+    size_t live = written < STREAM_RING_EVENTS ? written : STREAM_RING_EVENTS;
+    for (size_t i = 0; i < live; i++) {
+        free(stream->ring[i].notes);
+    }
+    free(stream->pending_keys);
+    
+    if (stream->simplifier.removed > 0) {
+        printf("Simplified: removed %zu key events\n", stream->simplifier.removed);
+    }
+    simplifier_cleanup(&stream->simplifier);
+    
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->ready);
+    fclose(stream->file);
+    free(stream->ring);
+    free(stream->human);
+    free(stream);
+}
+
+size_t stream_oldest(SongStream* stream) {
+    size_t written = atomic_load(&stream->written);
+    return written > STREAM_RING_EVENTS ? written - STREAM_RING_EVENTS + 1 : 0;
+}
+
+// Blocks until event index is decoded. NULL once the song is over. The
+// player checks stream_behind() first, so this only waits after a rewind
+// past the ring reopened the stream; the main loop stalls until the
+// producer gets back to index.
+const NoteInfo* stream_event(size_t index, HumanTiming* human) {
+    if (index < stream_oldest(songStream)) {
+        stream_close(songStream);
+        songStream = stream_open(songPath);
+        if (!songStream) return NULL;
+    }
+    
+    while (atomic_load(&songStream->written) <= index) {
+        // The last push and eof can both land after the check above.
+        if (songStream->eof && atomic_load(&songStream->written) <= index) return NULL;
+        stream_wait(songStream, 50);
+    }
+    
+    size_t slot = index % STREAM_RING_EVENTS;
+    *human = songStream->human[slot];
+    return &songStream->ring[slot];
+}
+
+// True while the producer just hasn't decoded index yet, so the player can
+// retry later instead of blocking the main loop.
+int stream_behind(size_t index) {
+    if (!streamMode || !songStream || index < stream_oldest(songStream)) return 0;
+    if (atomic_load(&songStream->written) > index) return 0;
+    return !songStream->eof;
+}
+
+const NoteInfo* event_at(size_t index, HumanTiming* human, int* has_human) {
+    if (streamMode) {
+        *has_human = 1;
+        return songStream ? stream_event(index, human) : NULL;
+    }
+    
+    if (!infoTuple || index >= infoTuple->notes_count) return NULL;
+    
+    *has_human = infoTuple->human != NULL;
+    if (*has_human) *human = infoTuple->human[index];
+    return &infoTuple->notes[index];
+}
+
+size_t known_event_count();
+int load_current_song();
+void unload_current_song();
+
+int telemetry_open() {
+    snprintf(telemetryName, sizeof(telemetryName), "/" TELEMETRY_PREFIX "%d", (int)getpid());
+    
+    int fd = shm_open(telemetryName, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    
+    if (ftruncate(fd, sizeof(TelemetryBlock)) != 0) {
+        close(fd);
+        shm_unlink(telemetryName);
+        return 0;
+    }
+    
+    void* block = mmap(NULL, sizeof(TelemetryBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        shm_unlink(telemetryName);
+        return 0;
+    }
+    
+    telemetry = block;
+    telemetry->version = TELEMETRY_VERSION;
+    telemetry->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    telemetry->magic = TELEMETRY_MAGIC;
+    return 1;
+}
+
+void telemetry_close() {
+    if (!telemetry) return;
+    
+    munmap(telemetry, sizeof(TelemetryBlock));
+    shm_unlink(telemetryName);
+    telemetry = NULL;
+}
+
+// Plain stores into the mapped block. If another thread is mid-publish we
+// skip this one rather than wait; the next event publishes again anyway.
+void telemetry_publish() {
+    if (!telemetry || atomic_flag_test_and_set(&telemetryBusy)) return;
+    
+    size_t count = known_event_count();
+    liveStats.position = storedIndex;
+    liveStats.event_count = count == SIZE_MAX ? 0 : count;
+    liveStats.playing = isPlaying;
+    liveStats.held_keys = heldNotes_count;
+    liveStats.elapsed = elapsedTime;
+    liveStats.duration = !streamMode && infoTuple ? infoTuple->total_duration : 0;
+    liveStats.playback_speed = playback_speed;
+    liveStats.updated = monotonic_seconds();
+    
+    telemetry_write(telemetry, &liveStats);
+    atomic_flag_clear(&telemetryBusy);
+}
+
+#define COMMAND_QUEUE_SIZE 256
+
+typedef enum {
+    CMD_PLAY,
+    CMD_PAUSE,
+    CMD_TOGGLE,
+    CMD_SEEK,
+    CMD_SEEK_BY,
+    CMD_REWIND,
+    CMD_SKIP,
+    CMD_SPEED,
+    CMD_SPEED_UP,
+    CMD_SLOW_DOWN,
+    CMD_LOAD,
+    CMD_LEGIT
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    double value;
+    char* path;
+} Command;
+
+// Bounded MPSC ring (Vyukov style): every slot carries a sequence number, so
+// producers claim slots with one CAS and the consumer never takes a lock.
+typedef struct {
+    _Atomic size_t seq;
+    Command command;
+} CommandSlot;
+
+CommandSlot commandQueue[COMMAND_QUEUE_SIZE];
+_Atomic size_t commandHead = 0;
+_Atomic size_t commandTail = 0;
+atomic_flag commandConsumer = ATOMIC_FLAG_INIT;
+int commandWake = -1;
+int playerTimer = -1;
+
+void drain_commands();
+
+void command_queue_init() {
+    playerTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    for (size_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+        atomic_store(&commandQueue[i].seq, i);
+    }
+    commandWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+int command_push(const Command* command) {
+    size_t pos = atomic_load_explicit(&commandHead, memory_order_relaxed);
+    CommandSlot* slot;
+    
+    for (;;) {
+        slot = &commandQueue[pos % COMMAND_QUEUE_SIZE];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak(&commandHead, &pos, pos + 1)) break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&commandHead, memory_order_relaxed);
+        }
+    }
+    
+    slot->command = *command;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+int command_pending() {
+    size_t pos = atomic_load(&commandTail);
+    return atomic_load_explicit(&commandQueue[pos % COMMAND_QUEUE_SIZE].seq, memory_order_acquire) == pos + 1;
+}
+
+int command_pop(Command* command) {
+    size_t pos = atomic_load_explicit(&commandTail, memory_order_relaxed);
+    CommandSlot* slot = &commandQueue[pos % COMMAND_QUEUE_SIZE];
+    
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) return 0;
+    
+    *command = slot->command;
+    atomic_store_explicit(&slot->seq, pos + COMMAND_QUEUE_SIZE, memory_order_release);
+    atomic_store(&commandTail, pos + 1);
+    return 1;
+}
+
+// Pokes the reactor, which applies the queue.
+void wake_consumer() {
+    uint64_t one = 1;
+    if (write(commandWake, &one, sizeof(one)) < 0) {
+        // The counter is saturated, which already means "wake up".
+    }
+}
+
+int send_command(CommandType type, double value, char* path) {
+    Command command = {type, value, path};
+    if (!command_push(&command)) return 0;
+    
+    wake_consumer();
+    return 1;
+}
+
+double epsWindowStart = 0;
+uint64_t epsWindowKeys = 0;
+
+#define PLAYER_BURST 64
+#define SPEED_RAMP_STEPS 16
+
+// Maps song seconds to wall seconds. Linear from the anchor at `speed`; a ramp
+// walks the speed to `target` in SPEED_RAMP_STEPS linear segments, re-anchoring
+// at each segment end, so every lookup stays O(1).
+typedef struct {
+    double wall;          // anchor, CLOCK_MONOTONIC
+    double song;          // song seconds at the anchor
+    double speed;         // song seconds per wall second from the anchor on
+    double target;
+    double step;          // wall seconds per ramp segment
+    double segment_end;   // 0 when not ramping
+    int steps_left;
+} SongClock;
+
+SongClock songClock = {0, 0, 1.0, 1.0, 0, 0, 0};
+double speedRamp = 0;
+
+double song_clock_song(const SongClock* clock, double wall) {
+    return clock->song + (wall - clock->wall) * clock->speed;
+}
+
+double song_clock_wall(const SongClock* clock, double song) {
+    return clock->wall + (song - clock->song) / clock->speed;
+}
+
+// Pins song time `song` to `now` at a steady speed, dropping any ramp.
+void song_clock_start(SongClock* clock, double now, double song, double speed) {
+    *clock = (SongClock){now, song, speed, speed, 0, 0, 0};
+}
+
+// Moves into whichever ramp segment `now` falls in.
+void song_clock_advance(SongClock* clock, double now) {
+    while (clock->segment_end && now >= clock->segment_end) {
+        clock->song = song_clock_song(clock, clock->segment_end);
+        clock->wall = clock->segment_end;
+        
+        if (--clock->steps_left <= 0) {
+            clock->speed = clock->target;
+            clock->segment_end = 0;
+        } else {
+            clock->speed += (clock->target - clock->speed) / clock->steps_left;
+            clock->segment_end += clock->step;
+        }
+    }
+}
+
+// Changes speed at `now` without moving the song position.
+void song_clock_set_speed(SongClock* clock, double now, double speed, double ramp) {
+    song_clock_advance(clock, now);
+    clock->song = song_clock_song(clock, now);
+    clock->wall = now;
+    clock->target = speed;
+    
+    if (ramp > 0 && speed != clock->speed) {
+        clock->step = ramp / SPEED_RAMP_STEPS;
+        clock->steps_left = SPEED_RAMP_STEPS;
+        clock->speed += (speed - clock->speed) / SPEED_RAMP_STEPS;
+        clock->segment_end = now + clock->step;
+    } else {
+        clock->speed = speed;
+        clock->segment_end = 0;
+        clock->steps_left = 0;
+    }
+}
+
+// Arms the playback timer for an absolute CLOCK_MONOTONIC time.
+void player_arm(double deadline) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = (time_t)deadline;
+    spec.it_value.tv_nsec = (long)((deadline - (time_t)deadline) * 1e9);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(playerTimer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void player_disarm() {
+    struct itimerspec spec = {0};
+    timerfd_settime(playerTimer, 0, &spec, NULL);
+}
+
+// Arms the timer for the next event, or for the end of the current ramp
+// segment if that comes first.
+void player_schedule(double due) {
+    if (songClock.segment_end && songClock.segment_end < due) {
+        due = songClock.segment_end;
+    }
+    player_arm(due);
+}
+
+// Catch-up when we fall behind the song clock (--catchup C,M,D, in ms late):
+// past C the gaps are halved until we are back on time, past M every event
+// already due is folded into one chord, and past D that chord keeps only its
+// top and bottom note. Being on time beats playing every note late.
+#define CATCHUP_COMPRESS 0.5
+
+bool catchupEnabled = true;
+double catchupCompress = 0.020;
+double catchupMerge = 0.080;
+double catchupDrop = 0.250;
+double lastFireWall = 0;
+double lastFireDue = 0;
+Simplifier catchupPicker;
+NoteInfo catchupChord;
+char catchupKeys[MAX_EVENT_KEYS + 1];
+
+// True if event_at() can hand out `index` without waiting on the stream.
+int event_ready(size_t index) {
+    if (streamMode) return songStream && index < atomic_load(&songStream->written);
+    return infoTuple && index < infoTuple->notes_count;
+}
+
+// Folds `note` and every following event that is already due into one chord,
+// applying releases on the way. Leaves storedIndex and elapsedTime on the last
+// event folded, so the caller finishes it like any other; *delay becomes its delay.
+const NoteInfo* catchup_merge(double now, const NoteInfo* note, double* delay, int drop) {
+    uint64_t chord = 0;
+    size_t merged = 0;
+    
+    while (1) {
+        if (note->release) {
+            releaseHeldNotes(note);
+        } else {
+            for (int i = 0; i < note->key_count; i++) {
+                int p = catchupPicker.pos[(unsigned char)note->notes[i]];
+                if (p >= 0) chord |= 1ULL << p;
+            }
+        }
+        
+        size_t next = storedIndex + 1;
+        double next_time = elapsedTime + *delay;
+        if (!event_ready(next) || song_clock_wall(&songClock, next_time) > now) break;
+        
+        HumanTiming human;
+        int has_human = 0;
+        const NoteInfo* following = event_at(next, &human, &has_human);
+        if (!following) break;
+        
+        storedIndex = next;
+        elapsedTime = next_time;
+        *delay = legitModeActive && has_human ? human.delay : floorToZero(following->delay);
+        note = following;
+        merged++;
+    }
+    
+    int budget = simplifyEnabled && simplifyConfig.max_chord_keys > 0 ? simplifyConfig.max_chord_keys : MAX_EVENT_KEYS;
+    if (drop) budget = 2;
+    if (budget > MAX_EVENT_KEYS) budget = MAX_EVENT_KEYS;
+    
+    uint64_t keep = simplifier_pick(&catchupPicker, chord, budget);
+    size_t n = 0;
+    for (int p = 0; p < 64 && pianoScale[p]; p++) {
+        if ((keep >> p) & 1) catchupKeys[n++] = pianoScale[p];
+    }
+    catchupKeys[n] = '\0';
+    
+    liveStats.catchup_merged += merged;
+    liveStats.catchup_dropped += __builtin_popcountll(chord) - n;
+    
+    // Only releases were due; they're done and releasing again is a no-op.
+    if (n == 0) return note;
+    
+    compile_note(&catchupChord, catchupKeys, n, 0, *delay);
+    catchupChord.notes = catchupKeys;
+    return &catchupChord;
+}
+
+// Keys of the current event already pressed. Legit mode rolls chords one key
+// at a time, each key its own sub-event on the schedule.
+int chordKey = 0;
+
+// Song seconds between rolled chord keys, squeezed so the roll fits in the
+// event's own slot and never pushes the next event back.
+double roll_gap(const NoteInfo* note, const HumanTiming* human, int has_human, double delay) {
+    if (!legitModeActive || !has_human || note->release || note->key_count < 2) return 0;
+    
+    double gap = human->chord_gap;
+    if (delay > 0 && gap * (note->key_count - 1) >= delay) {
+        gap = delay / note->key_count;
+    }
+    return gap;
+}
+
+// Runs when the timer fires: plays every event (or rolled chord key) that is
+// due and arms the timer for the next one. elapsedTime is the song time of the
+// current event and the song clock turns it into a deadline, so nothing is
+// chained off "now" and scheduling overhead doesn't pile up into drift.
+void player_step() {
+    TRACE_SCOPE("wake");
+    
+    for (int burst = 0; burst < PLAYER_BURST && isPlaying; burst++) {
+        double now = monotonic_seconds();
+        song_clock_advance(&songClock, now);
+        
+        if (stream_behind(storedIndex)) {
+            player_arm(now + STREAM_RETRY_SECONDS);
+            return;
+        }
+        
+        HumanTiming human;
+        int has_human = 0;
+        const NoteInfo* noteInfo = event_at(storedIndex, &human, &has_human);
+        
+        if (!noteInfo) {
+            if (isPlaying) {
+                isPlaying = false;
+                storedIndex = 0;
+                elapsedTime = 0;
+                chordKey = 0;
+            }
+            player_disarm();
+            telemetry_publish();
+            return;
+        }
+        
+        double delay = floorToZero(noteInfo->delay);
+        
+        if (legitModeActive && has_human) {
+            delay = human.delay;
+        }
+        
+        double gap = roll_gap(noteInfo, &human, has_human, delay);
+        double due = song_clock_wall(&songClock, elapsedTime + chordKey * gap);
+        // With look-ahead, wake half a horizon early and send everything that
+        // falls within a whole one, so one wake-up covers a window of events.
+        if (due > now + lookAhead) {
+            player_schedule(due - lookAhead / 2);
+            return;
+        }
+        
+        if (chordKey == 0) {
+            liveStats.lateness = now - due;
+            if (liveStats.lateness > liveStats.max_lateness) {
+                liveStats.max_lateness = liveStats.lateness;
+            }
+            
+            if (catchupEnabled && liveStats.lateness >= catchupMerge) {
+                noteInfo = catchup_merge(now, noteInfo, &delay, liveStats.lateness >= catchupDrop);
+                gap = 0;
+                due = song_clock_wall(&songClock, elapsedTime);
+            } else if (catchupEnabled && liveStats.lateness >= catchupCompress) {
+                double target = lastFireWall + (due - lastFireDue) * CATCHUP_COMPRESS;
+                if (target > now) {
+                    player_arm(target);
+                    return;
+                }
+                liveStats.catchup_compressed++;
+            }
+            
+            lastFireWall = now;
+            lastFireDue = due;
+        }
+        
+        inject_at(due);
+        
+        adjustTempoForCurrentNote();
+        
+        double start = elapsedTime;
+        
+        if (noteInfo->release) {
+            releaseHeldNotes(noteInfo);
+        } else {
+            while (chordKey < noteInfo->key_count) {
+                press_event_key(noteInfo, chordKey);
+                liveStats.keys_sent++;
+                
+                if (heldNotes_count >= heldNotes_capacity) {
+                    heldNotes_capacity = heldNotes_capacity ? heldNotes_capacity * 2 : 16;
+                    heldNotes = realloc(heldNotes, sizeof(HeldNote) * heldNotes_capacity);
+                }
+                
+                heldNotes[heldNotes_count].keycode = noteInfo->keycodes[chordKey];
+                heldNotes[heldNotes_count].hold_until = start + noteInfo->delay;
+                heldNotes_count++;
+                
+                chordKey++;
+                if (gap > 0) break;
+            }
+            
+            if (chordKey < noteInfo->key_count) continue;
+            chordKey = 0;
+            
+            double elapsed_mins = start / 60;
+            double elapsed_secs = start - (int)elapsed_mins * 60;
+            
+            if (streamMode) {
+                printf("[%dm %ds] %s\n", (int)elapsed_mins, (int)elapsed_secs, noteInfo->notes);
+            } else {
+                double total_duration = infoTuple->total_duration;
+                double total_mins = total_duration / 60;
+                double total_secs = total_duration - (int)total_mins * 60;
+                
+                printf("[%dm %ds/%dm %ds] %s\n", 
+                       (int)elapsed_mins, (int)elapsed_secs,
+                       (int)total_mins, (int)total_secs,
+                       noteInfo->notes);
+            }
+        }
+        
+        elapsedTime += delay > 0 ? delay : 0;
+        storedIndex++;
+        
+        if (now - epsWindowStart >= 1.0) {
+            liveStats.events_per_sec = (liveStats.keys_sent - epsWindowKeys) / (now - epsWindowStart);
+            epsWindowStart = now;
+            epsWindowKeys = liveStats.keys_sent;
+        }
+        telemetry_publish();
+    }
+    
+    if (isPlaying) player_arm(monotonic_seconds());
+}
+
+// Play and pause only arm or disarm the timer; there is no player thread.
+void onDelPress() {
+    isPlaying = !isPlaying;
+    
+    if (isPlaying) {
+        printf("Playing...\n");
+        targets_prime();
+        
+        double now = monotonic_seconds();
+        epsWindowStart = now;
+        epsWindowKeys = liveStats.keys_sent;
+        song_clock_start(&songClock, now, elapsedTime, playback_speed);
+        lastFireWall = lastFireDue = now;
+        player_arm(now);
+    } else {
+        printf("Stopping...\n");
+        player_disarm();
+        
+        // With --lookahead, up to that much already sent still plays; the
+        // releases queue up behind it.
+        injectDue = 0;
+        for (size_t i = 0; i < heldNotes_count; i++) {
+            release_keycode(heldNotes[i].keycode);
+        }
+        heldNotes_count = 0;
+    }
+    telemetry_publish();
+}
+
+void rewindSong() {
+    int oldest = streamMode && songStream ? (int)stream_oldest(songStream) : 0;
+    
+    if (storedIndex - 10 < oldest) {
+        storedIndex = oldest;
+    } else {
+        storedIndex -= 10;
+    }
+    printf("Rewound to %d\n", storedIndex);
+}
+
+size_t known_event_count() {
+    if (streamMode) {
+        if (!songStream) return 0;
+        return songStream->eof ? atomic_load(&songStream->written) : SIZE_MAX;
+    }
+    return infoTuple ? infoTuple->notes_count : 0;
+}
+
+void skip() {
+    if ((size_t)storedIndex + 10 > known_event_count()) {
+        isPlaying = false;
+        storedIndex = 0;
+    } else {
+        storedIndex += 10;
+    }
+    printf("Skipped to %d\n", storedIndex);
+}
+
+void printControls() {
+    printf("\n====================\n");
+    printf("      Controls      \n");
     printf("====================\n");
     printf("DELETE   : Play/Pause\n");
     printf("HOME     : Rewind\n");
@@ -528,118 +1668,665 @@ void printControls() {
     printf("====================\n\n");
 }
 
-NoteInfo* simplify_notes(NoteInfo* notes, size_t count) {
-    return notes;
+void seek_to(long index) {
+    long oldest = streamMode && songStream ? (long)stream_oldest(songStream) : 0;
+    size_t count = known_event_count();
+    
+    if (index < oldest) index = oldest;
+    if (count != SIZE_MAX && (size_t)index >= count) {
+        isPlaying = false;
+        index = 0;
+    }
+    
+    storedIndex = index;
+    printf("Seeked to %d\n", storedIndex);
 }
 
-int main() {
-    init_keyboard();
-    srand(time(NULL));
+void set_speed(double speed) {
+    if (!(speed > 0)) return;
     
-    infoTuple = processFile();
-    if (!infoTuple) {
-        printf("Can't start: song file is missing or broken\n");
-        return 1;
+    playback_speed = speed;
+    printf("Playback speed is now %.2fx\n", playback_speed);
+}
+
+void set_legit_mode(int mode) {
+    if (mode < 0) mode = !legitModeActive;
+    if (mode != legitModeActive) toggleLegitMode();
+}
+
+void reload_song(char* path) {
+    printf("Reloading song...\n");
+    
+    if (isPlaying) onDelPress();
+    storedIndex = 0;
+    elapsedTime = 0;
+    chordKey = 0;
+    
+    static char* loadedPath = NULL;
+    if (path) {
+        free(loadedPath);
+        loadedPath = path;
+        songPath = path;
     }
     
-    NoteInfo* parsed_notes = parseInfo(infoTuple);
-    if (!parsed_notes) {
-        printf("No notes to play\n");
-        free(infoTuple);
-        return 1;
+    unload_current_song();
+    load_current_song();
+    telemetry_publish();
+}
+
+// Song seconds before event `index`, so a jump keeps the progress line and the
+// clock right. The stream only knows where it is, so it keeps its count.
+double song_time_at(size_t index) {
+    if (streamMode || !infoTuple) return elapsedTime;
+    
+    double seconds = 0;
+    for (size_t i = 0; i < index && i < infoTuple->notes_count; i++) {
+        double delay = legitModeActive && infoTuple->human ? infoTuple->human[i].delay : infoTuple->notes[i].delay;
+        seconds += floorToZero(delay);
+    }
+    return seconds;
+}
+
+void apply_command(const Command* command) {
+    double old_speed = playback_speed;
+    int old_index = storedIndex;
+    
+    switch (command->type) {
+        case CMD_PLAY:
+            if (!isPlaying) onDelPress();
+            break;
+        case CMD_PAUSE:
+            if (isPlaying) onDelPress();
+            break;
+        case CMD_TOGGLE:
+            onDelPress();
+            break;
+        case CMD_SEEK:
+            seek_to((long)command->value);
+            break;
+        case CMD_SEEK_BY:
+            seek_to(storedIndex + (long)command->value);
+            break;
+        case CMD_REWIND:
+            rewindSong();
+            break;
+        case CMD_SKIP:
+            skip();
+            break;
+        case CMD_SPEED:
+            set_speed(command->value);
+            break;
+        case CMD_SPEED_UP:
+            speedUp();
+            break;
+        case CMD_SLOW_DOWN:
+            slowDown();
+            break;
+        case CMD_LOAD:
+            reload_song(command->path);
+            break;
+        case CMD_LEGIT:
+            set_legit_mode((int)command->value);
+            break;
     }
     
-    free(infoTuple->notes);
-    infoTuple->notes = parsed_notes;
-    infoTuple->notes_count = 0;
+    if (storedIndex != old_index) {
+        elapsedTime = song_time_at(storedIndex);
+        chordKey = 0;
+    }
     
-    while (infoTuple->notes[infoTuple->notes_count].notes != NULL) {
-        infoTuple->notes_count++;
+    // A jump plays the new position right away; a speed change re-anchors the
+    // clock where the song is now and moves the pending deadline with it.
+    if (!isPlaying) return;
+    double now = monotonic_seconds();
+    if (storedIndex != old_index) {
+        song_clock_start(&songClock, now, elapsedTime, playback_speed);
+        lastFireWall = lastFireDue = now;
+        player_arm(now);
+    } else if (playback_speed != old_speed) {
+        song_clock_set_speed(&songClock, now, playback_speed, speedRamp);
+        player_arm(now);
+    }
+}
+
+// The reactor applies the queue. The flag only keeps a control "status"
+// from reading the song while a load swaps it.
+void drain_commands() {
+    do {
+        if (atomic_flag_test_and_set(&commandConsumer)) return;
+        
+        Command command;
+        while (command_pop(&command)) {
+            apply_command(&command);
+        }
+        
+        atomic_flag_clear(&commandConsumer);
+    } while (command_pending());
+}
+
+#define MAX_CONTROL_CLIENTS 16
+#define CONTROL_LINE_MAX 4096
+
+char* controlPath = NULL;
+bool controlEnabled = true;
+int controlSocket = -1;
+int controlWake = -1;          // eventfd that tells the control thread to exit
+pthread_t controlThreadId;
+
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[CONTROL_LINE_MAX];
+} ControlClient;
+
+void control_reply(int fd, const char* text) {
+    size_t len = strlen(text);
+    while (len > 0) {
+        ssize_t written = send(fd, text, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        text += written;
+        len -= written;
+    }
+}
+
+// One command per line, answered with "ok", "error: ..." or a status line.
+void control_command(int fd, char* line) {
+    char* arg = strchr(line, ' ');
+    if (arg) {
+        *arg++ = 0;
+        while (*arg == ' ') arg++;
     }
     
-    infoTuple->notes = simplify_notes(infoTuple->notes, infoTuple->notes_count);
+    int queued = 1;
     
-    printControls();
+    if (strcmp(line, "play") == 0) {
+        queued = send_command(CMD_PLAY, 0, NULL);
+    } else if (strcmp(line, "pause") == 0) {
+        queued = send_command(CMD_PAUSE, 0, NULL);
+    } else if (strcmp(line, "toggle") == 0) {
+        queued = send_command(CMD_TOGGLE, 0, NULL);
+    } else if (strcmp(line, "seek") == 0 && arg && *arg) {
+        double value = atof(arg);
+        queued = send_command(*arg == '+' || *arg == '-' ? CMD_SEEK_BY : CMD_SEEK, value, NULL);
+    } else if (strcmp(line, "speed") == 0 && arg && atof(arg) > 0) {
+        queued = send_command(CMD_SPEED, atof(arg), NULL);
+    } else if (strcmp(line, "load") == 0) {
+        char* path = arg && *arg ? strdup(arg) : NULL;
+        queued = send_command(CMD_LOAD, 0, path);
+        if (!queued) free(path);
+    } else if (strcmp(line, "legit") == 0 && arg && (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0 || strcmp(arg, "toggle") == 0)) {
+        queued = send_command(CMD_LEGIT, strcmp(arg, "on") == 0 ? 1 : strcmp(arg, "off") == 0 ? 0 : -1, NULL);
+    } else if (strcmp(line, "trace") == 0) {
+        char path[PATH_MAX];
+        if (arg && *arg) {
+            snprintf(path, sizeof(path), "%s", arg);
+        } else if (traceFile) {
+            snprintf(path, sizeof(path), "%s", traceFile);
+        } else {
+            snprintf(path, sizeof(path), "/tmp/play_core.%d.trace.json", (int)getpid());
+        }
+        
+        char reply[PATH_MAX + 32];
+        snprintf(reply, sizeof(reply), trace_export(path) ? "ok %s\n" : "error: no trace for %s\n", path);
+        control_reply(fd, reply);
+        return;
+    } else if (strcmp(line, "status") == 0) {
+        // Holding the consumer flag keeps a queued load from swapping the song under us.
+        while (atomic_flag_test_and_set(&commandConsumer)) sched_yield();
+        
+        size_t count = known_event_count();
+        char status[PATH_MAX + 128];
+        snprintf(status, sizeof(status), "%s %d/%s%zu speed %.2f legit %s song %s\n",
+                 isPlaying ? "playing" : "paused", storedIndex,
+                 count == SIZE_MAX ? "~" : "", count == SIZE_MAX ? (size_t)storedIndex : count,
+                 playback_speed, legitModeActive ? "on" : "off", songPath);
+        
+        atomic_flag_clear(&commandConsumer);
+        if (command_pending()) wake_consumer();
+        
+        control_reply(fd, status);
+        return;
+    } else {
+        control_reply(fd, "error: unknown command\n");
+        return;
+    }
     
-    Display* dpy = XOpenDisplay(NULL);
-    if (!dpy) {
-        fprintf(stderr, "Cannot open display\n");
-        return 1;
+    control_reply(fd, queued ? "ok\n" : "error: queue full\n");
+}
+
+// Feeds whatever arrived to control_command line by line. Returns 0 on hangup.
+int control_read(ControlClient* client) {
+    ssize_t got = recv(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len, 0);
+    if (got <= 0) return got < 0 && errno == EINTR;
+    client->len += got;
+    
+    char* start = client->buf;
+    char* newline;
+    while ((newline = memchr(start, '\n', client->buf + client->len - start))) {
+        *newline = 0;
+        if (newline > start && newline[-1] == '\r') newline[-1] = 0;
+        if (*start) control_command(client->fd, start);
+        start = newline + 1;
     }
     
-    Window root = DefaultRootWindow(dpy);
-    XEvent ev;
+    client->len -= start - client->buf;
+    memmove(client->buf, start, client->len);
     
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Delete), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Home), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_End), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Page_Up), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Page_Down), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Insert), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_F5), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Escape), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+    if (client->len == sizeof(client->buf) - 1) {
+        control_reply(client->fd, "error: line too long\n");
+        return 0;
+    }
+    return 1;
+}
+
+void* controlThread(void* arg) {
+    (void)arg;
     
-    printf("Press ESC to exit\n");
+    ControlClient* clients = calloc(MAX_CONTROL_CLIENTS, sizeof(ControlClient));
+    if (!clients) return NULL;
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) clients[i].fd = -1;
     
     while (1) {
-        XNextEvent(dpy, &ev);
-        if (ev.type == KeyPress) {
-            KeySym keysym = XLookupKeysym(&ev.xkey, 0);
+        struct pollfd pfds[MAX_CONTROL_CLIENTS + 2];
+        pfds[0] = (struct pollfd){controlSocket, POLLIN, 0};
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+            pfds[i + 1] = (struct pollfd){clients[i].fd, POLLIN, 0};
+        }
+        pfds[MAX_CONTROL_CLIENTS + 1] = (struct pollfd){controlWake, POLLIN, 0};
+        
+        if (poll(pfds, MAX_CONTROL_CLIENTS + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[MAX_CONTROL_CLIENTS + 1].revents) break;
+        
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept4(controlSocket, NULL, NULL, SOCK_CLOEXEC);
+            int slot = -1;
+            for (int i = 0; fd >= 0 && i < MAX_CONTROL_CLIENTS && slot < 0; i++) {
+                if (clients[i].fd < 0) slot = i;
+            }
+            if (slot >= 0) {
+                clients[slot].fd = fd;
+                clients[slot].len = 0;
+            } else if (fd >= 0) {
+                control_reply(fd, "error: too many clients\n");
+                close(fd);
+            }
+        }
+        
+        for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+            if (clients[i].fd < 0 || !pfds[i + 1].revents) continue;
             
-            if (keysym == XK_Delete) {
-                onDelPress();
-            } else if (keysym == XK_Home) {
-                rewind();
-            } else if (keysym == XK_End) {
-                skip();
-            } else if (keysym == XK_Page_Up) {
-                speedUp();
-            } else if (keysym == XK_Page_Down) {
-                slowDown();
-            } else if (keysym == XK_Insert) {
-                toggleLegitMode();
-            } else if (keysym == XK_F5) {
-                printf("Reloading song...\n");
-                isPlaying = false;
-                
-                for (size_t i = 0; i < infoTuple->notes_count; i++) {
-                    free(infoTuple->notes[i].notes);
-                }
-                free(infoTuple->notes);
-                free(infoTuple);
-                
-                infoTuple = processFile();
-                if (infoTuple) {
-                    NoteInfo* parsed_notes = parseInfo(infoTuple);
-                    if (parsed_notes) {
-                        free(infoTuple->notes);
-                        infoTuple->notes = parsed_notes;
-                        infoTuple->notes_count = 0;
-                        
-                        while (infoTuple->notes[infoTuple->notes_count].notes != NULL) {
-                            infoTuple->notes_count++;
-                        }
-                    }
+            if (!control_read(&clients[i])) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+    }
+    
+    for (int i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+    free(clients);
+    return NULL;
+}
+
+int control_open() {
+    if (!controlPath) {
+        controlPath = malloc(64);
+        if (!controlPath) return 0;
+        snprintf(controlPath, 64, "/tmp/play_core.%d.sock", (int)getpid());
+    }
+    
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(controlPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path is too long\n");
+        return 0;
+    }
+    strcpy(addr.sun_path, controlPath);
+    
+    controlSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (controlSocket < 0) return 0;
+    
+    unlink(controlPath);
+    if (bind(controlSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(controlSocket, 8) != 0) {
+        perror("Control socket");
+        close(controlSocket);
+        controlSocket = -1;
+        return 0;
+    }
+    chmod(controlPath, 0600);
+    
+    controlWake = eventfd(0, EFD_CLOEXEC);
+    if (controlWake < 0 || pthread_create(&controlThreadId, NULL, controlThread, NULL) != 0) {
+        perror("Control socket");
+        if (controlWake >= 0) close(controlWake);
+        close(controlSocket);
+        controlSocket = -1;
+        unlink(controlPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Stops the control thread before anything it reads is torn down.
+void control_close() {
+    if (controlSocket < 0) return;
+    
+    uint64_t one = 1;
+    if (write(controlWake, &one, sizeof(one)) < 0) perror("Control socket");
+    shutdown(controlSocket, SHUT_RDWR);
+    pthread_join(controlThreadId, NULL);
+    
+    close(controlSocket);
+    close(controlWake);
+    controlSocket = -1;
+    controlWake = -1;
+    unlink(controlPath);
+}
+
+size_t simplify_notes(NoteInfo* notes, double* times, size_t count) {
+    if (!simplifyEnabled) return count;
+    
+    Simplifier simplifier;
+    simplifier_init(&simplifier, &simplifyConfig, pianoScale);
+    
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (simplifier_feed(&simplifier, times[i], notes[i].notes) > 0) {
+            notes[kept] = notes[i];
+            times[kept++] = times[i];
+        }
+    }
+    
+    if (simplifier.removed > 0) {
+        printf("Simplified: removed %zu key events\n", simplifier.removed);
+    }
+    
+    simplifier_cleanup(&simplifier);
+    return kept;
+}
+
+void free_song(SongInfo* song) {
+    if (!song) return;
+    
+    for (size_t i = 0; i < song->notes_count; i++) {
+        if (!in_pool(song, song->notes[i].notes)) free(song->notes[i].notes);
+    }
+    free(song->notes);
+    free(song->human);
+    free(song->pool);
+    free(song);
+}
+
+SongInfo* load_song() {
+    SongInfo* song = processFile();
+    if (!song) return NULL;
+    
+    double* times = resolve_song_times(song);
+    if (!times || song->notes_count == 0) {
+        printf("No notes to play\n");
+        free(times);
+        free_song(song);
+        return NULL;
+    }
+    
+    song->notes_count = simplify_notes(song->notes, times, song->notes_count);
+    fill_delays(song->notes, times, song->notes_count);
+    free(times);
+    
+    if (!compile_events(song)) {
+        printf("Out of memory compiling song\n");
+        free_song(song);
+        return NULL;
+    }
+    build_human_schedule(song, legitSeed);
+    
+    return song;
+}
+
+int load_current_song() {
+    if (streamMode) {
+        songStream = stream_open(songPath);
+        return songStream != NULL;
+    }
+    
+    infoTuple = load_song();
+    return infoTuple != NULL;
+}
+
+void unload_current_song() {
+    if (streamMode) {
+        stream_close(songStream);
+        songStream = NULL;
+    } else {
+        free_song(infoTuple);
+        infoTuple = NULL;
+    }
+}
+
+// Returns 0 once ESC asks us to quit.
+int handle_hotkey(XEvent* ev) {
+    if (ev->type != KeyPress) return 1;
+    
+    KeySym keysym = XLookupKeysym(&ev->xkey, 0);
+    
+    if (keysym == XK_Delete) {
+        send_command(CMD_TOGGLE, 0, NULL);
+    } else if (keysym == XK_Home) {
+        send_command(CMD_REWIND, 0, NULL);
+    } else if (keysym == XK_End) {
+        send_command(CMD_SKIP, 0, NULL);
+    } else if (keysym == XK_Page_Up) {
+        send_command(CMD_SPEED_UP, 0, NULL);
+    } else if (keysym == XK_Page_Down) {
+        send_command(CMD_SLOW_DOWN, 0, NULL);
+    } else if (keysym == XK_Insert) {
+        send_command(CMD_LEGIT, -1, NULL);
+    } else if (keysym == XK_F5) {
+        send_command(CMD_LOAD, 0, NULL);
+    } else if (keysym == XK_Escape) {
+        return 0;
+    }
+    return 1;
+}
+
+enum { REACTOR_COMMANDS, REACTOR_TIMER, REACTOR_X, REACTOR_SIGNAL };
+
+// Blocked in every thread and read off a signalfd, so these quit like ESC.
+sigset_t quitSignals;
+
+// The one loop that runs playback: hotkeys from the X connection, commands
+// from the eventfd and the next note from the timerfd, all on this thread.
+void run_reactor(Display* dpy) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    
+    struct epoll_event event = {EPOLLIN, {.u32 = REACTOR_COMMANDS}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, commandWake, &event);
+    event.data.u32 = REACTOR_TIMER;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, playerTimer, &event);
+    if (dpy) {
+        event.data.u32 = REACTOR_X;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ConnectionNumber(dpy), &event);
+    }
+    int signal_fd = signalfd(-1, &quitSignals, SFD_CLOEXEC);
+    if (signal_fd >= 0) {
+        event.data.u32 = REACTOR_SIGNAL;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+    }
+    
+    drain_commands();
+    
+    int running = 1;
+    while (running) {
+        // Xlib may already hold events it read off the socket.
+        while (dpy && running && XPending(dpy)) {
+            XEvent ev;
+            XNextEvent(dpy, &ev);
+            running = handle_hotkey(&ev);
+        }
+        if (!running) break;
+        drain_commands();
+        
+        struct epoll_event ready[4];
+        int count = epoll_wait(epoll_fd, ready, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        for (int i = 0; i < count; i++) {
+            uint64_t value;
+            
+            if (ready[i].data.u32 == REACTOR_COMMANDS) {
+                if (read(commandWake, &value, sizeof(value)) < 0) value = 0;
+                drain_commands();
+            } else if (ready[i].data.u32 == REACTOR_TIMER) {
+                if (read(playerTimer, &value, sizeof(value)) < 0) value = 0;
+                player_step();
+            } else if (ready[i].data.u32 == REACTOR_SIGNAL) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    printf("Got %s, quitting\n", strsignal(info.ssi_signo));
+                    running = 0;
                 }
-            } else if (keysym == XK_Escape) {
-                break;
             }
         }
     }
     
-    XUngrabKey(dpy, AnyKey, AnyModifier, root);
-    XCloseDisplay(dpy);
+    if (signal_fd >= 0) close(signal_fd);
+    close(epoll_fd);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-simplify") == 0) {
+            simplifyEnabled = false;
+        } else if (strcmp(argv[i], "--max-chord") == 0 && i + 1 < argc) {
+            simplifyConfig.max_chord_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-eps") == 0 && i + 1 < argc) {
+            simplifyConfig.max_events_per_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-span") == 0 && i + 1 < argc) {
+            simplifyConfig.max_span = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            legitSeed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            streamMode = true;
+        } else if (strcmp(argv[i], "--no-telemetry") == 0) {
+            telemetryEnabled = false;
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            controlPath = argv[++i];
+        } else if (strcmp(argv[i], "--no-control") == 0) {
+            controlEnabled = false;
+        } else if (strcmp(argv[i], "--catchup") == 0 && i + 1 < argc) {
+            double compress, merge, drop;
+            i++;
+            if (strcmp(argv[i], "off") == 0) {
+                catchupEnabled = false;
+            } else if (sscanf(argv[i], "%lf,%lf,%lf", &compress, &merge, &drop) == 3) {
+                catchupCompress = compress / 1000.0;
+                catchupMerge = merge / 1000.0;
+                catchupDrop = drop / 1000.0;
+            }
+        } else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+            // Capped so pause and seek still answer within a fraction of a second.
+            lookAhead = atof(argv[++i]) / 1000.0;
+            if (lookAhead < 0) lookAhead = 0;
+            if (lookAhead > 0.2) lookAhead = 0.2;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (strcmp(argv[i], "--speed-ramp") == 0 && i + 1 < argc) {
+            speedRamp = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc && targetCount < MAX_TARGETS) {
+            targetNames[targetCount++] = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--no-simplify] [--max-chord N] [--max-eps N] [--max-span N] [--seed N] [--stream] [--no-telemetry] [--control PATH] [--no-control] [--speed-ramp SECONDS] [--catchup C,M,D|off] [--lookahead MS] [--trace FILE] [--target DISPLAY]...\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    sigemptyset(&quitSignals);
+    sigaddset(&quitSignals, SIGINT);
+    sigaddset(&quitSignals, SIGTERM);
+    sigaddset(&quitSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &quitSignals, NULL);
+    
+    init_keyboard();
+    command_queue_init();
+    simplifier_init(&catchupPicker, &simplifyConfig, pianoScale);
+    
+    if (!legitSeed) {
+        legitSeed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+    printf("Legit mode seed: %llu\n", (unsigned long long)legitSeed);
+    
+    if (!load_current_song()) {
+        printf("Can't start: song file is missing or broken\n");
+        return 1;
+    }
+    
+    if (telemetryEnabled && telemetry_open()) {
+        printf("Telemetry: /dev/shm%s\n", telemetryName);
+        telemetry_publish();
+    }
     
-    for (size_t i = 0; i < infoTuple->notes_count; i++) {
-        free(infoTuple->notes[i].notes);
+    if (controlEnabled && control_open()) {
+        printf("Control socket: %s\n", controlPath);
     }
-    free(infoTuple->notes);
-    free(infoTuple);
+    
+    printControls();
+    
+    Display* dpy = XOpenDisplay(NULL);
+    if (!dpy && !(targetCount && controlSocket >= 0)) {
+        fprintf(stderr, "Cannot open display\n");
+        return 1;
+    }
+    
+    if (dpy) {
+        Window root = DefaultRootWindow(dpy);
+        
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Delete), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Home), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_End), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Page_Up), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Page_Down), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Insert), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_F5), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Escape), AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
+        
+        printf("Press ESC to exit\n");
+    } else {
+        printf("No $DISPLAY for hotkeys, use the control socket\n");
+    }
+    
+    run_reactor(dpy);
+    
+    if (isPlaying) onDelPress();
+    
+    if (dpy) {
+        XUngrabKey(dpy, AnyKey, AnyModifier, DefaultRootWindow(dpy));
+        XCloseDisplay(dpy);
+    }
+    
+    control_close();
+    unload_current_song();
     free(heldNotes);
+    telemetry_close();
+    targets_close();
     
     if (display) {
         XCloseDisplay(display);
     }
     
+    if (traceFile && trace_export(traceFile)) {
+        printf("Saved trace to %s\n", traceFile);
+    }
+    
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+// Lists every running play_core from its shared-memory telemetry block.
+// Read-only mappings and a seqlock, so the players never notice us.
+
+int watchSeconds = 0;
+int onlyPid = 0;
+int cleanStale = 0;
+
+int pid_alive(int pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+void format_clock(char* out, size_t size, double seconds) {
+    int whole = seconds > 0 ? (int)seconds : 0;
+    snprintf(out, size, "%dm %02ds", whole / 60, whole % 60);
+}
+
+void print_header() {
+    printf("%-8s %-8s %-15s %-17s %6s %9s %9s %7s %5s %9s %-14s  %s\n",
+           "PID", "STATE", "POSITION", "ELAPSED", "SPEED", "LATE ms", "MAX ms",
+           "KEYS/s", "HELD", "FLUSH us", "CATCHUP c/m/d", "SONG");
+}
+
+// Returns 1 if a row got printed.
+int show_block(const char* name) {
+    char path[300];
+    snprintf(path, sizeof(path), "/%s", name);
+    
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) return 0;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TelemetryBlock)) {
+        close(fd);
+        return 0;
+    }
+    
+    const TelemetryBlock* block = mmap(NULL, sizeof(TelemetryBlock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) return 0;
+    
+    if (block->magic != TELEMETRY_MAGIC || block->version != TELEMETRY_VERSION ||
+        (onlyPid && block->pid != onlyPid)) {
+        munmap((void*)block, sizeof(TelemetryBlock));
+        return 0;
+    }
+    
+    int pid = block->pid;
+    int alive = pid_alive(pid);
+    
+    TelemetryStats stats;
+    int ok = telemetry_read(block, &stats);
+    munmap((void*)block, sizeof(TelemetryBlock));
+    
+    if (!alive && cleanStale) {
+        shm_unlink(path);
+        printf("Removed stale block for pid %d\n", pid);
+        return 0;
+    }
+    if (!ok) {
+        printf("%-8d %-8s (busy, try again)\n", pid, alive ? "?" : "dead");
+        return 1;
+    }
+    
+    char position[32];
+    if (stats.event_count) {
+        snprintf(position, sizeof(position), "%llu/%llu",
+                 (unsigned long long)stats.position, (unsigned long long)stats.event_count);
+    } else {
+        snprintf(position, sizeof(position), "%llu", (unsigned long long)stats.position);
+    }
+    
+    char elapsed[16], duration[16], times[40];
+    format_clock(elapsed, sizeof(elapsed), stats.elapsed);
+    if (stats.duration > 0) {
+        format_clock(duration, sizeof(duration), stats.duration);
+        snprintf(times, sizeof(times), "%s/%s", elapsed, duration);
+    } else {
+        snprintf(times, sizeof(times), "%s", elapsed);
+    }
+    
+    char catchup[48];
+    snprintf(catchup, sizeof(catchup), "%llu/%llu/%llu",
+             (unsigned long long)stats.catchup_compressed, (unsigned long long)stats.catchup_merged,
+             (unsigned long long)stats.catchup_dropped);
+    
+    const char* state = !alive ? "dead" : stats.playing ? "playing" : "paused";
+    
+    printf("%-8d %-8s %-15s %-17s %5.2fx %9.2f %9.2f %7.1f %5u %9.1f %-14s  %016llx %lluB\n",
+           pid, state, position, times, stats.playback_speed,
+           stats.lateness * 1000.0, stats.max_lateness * 1000.0,
+           stats.events_per_sec, stats.held_keys, stats.flush_latency * 1e6, catchup,
+           (unsigned long long)stats.song_hash, (unsigned long long)stats.song_size);
+    return 1;
+}
+
+int show_all() {
+    DIR* dir = opendir("/dev/shm");
+    if (!dir) {
+        perror("Couldn't open /dev/shm");
+        return 0;
+    }
+    
+    size_t prefix = strlen(TELEMETRY_PREFIX);
+    int shown = 0;
+    
+    if (!cleanStale) print_header();
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, TELEMETRY_PREFIX, prefix) == 0) {
+            shown += show_block(entry->d_name);
+        }
+    }
+    closedir(dir);
+    
+    if (!shown && !cleanStale) printf("No play_core running\n");
+    return 1;
+}
+
+void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  --watch N   refresh every N seconds\n");
+    fprintf(stderr, "  --pid N     only show this player\n");
+    fprintf(stderr, "  --clean     remove blocks left behind by players that died\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watchSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pid") == 0 && i + 1 < argc) {
+            onlyPid = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--clean") == 0) {
+            cleanStale = 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (watchSeconds <= 0 || cleanStale) {
+        return show_all() ? 0 : 1;
+    }
+    
+    while (1) {
+        printf("\033[H\033[2J");
+        if (!show_all()) return 1;
+        fflush(stdout);
+        sleep(watchSeconds);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Shared by midi_core (offline) and play_core (load time). Feed events in time
+// order, one at a time; each event string gets trimmed in place.
+
+typedef struct {
+    int max_chord_keys;      // keys per chord, 0 = no cap
+    int max_events_per_sec;  // key events in any 1s window, 0 = no cap
+    int max_span;            // semitones one hand can reach, 0 = no cap
+} SimplifyConfig;
+
+typedef struct {
+    double time;
+    int count;
+} SimplifyWindowEntry;
+
+typedef struct {
+    SimplifyConfig cfg;
+    int8_t pos[256];            // key char -> position in the piano scale, -1 if not a key
+    uint64_t held;              // keys pressed and not released yet
+    SimplifyWindowEntry* window;
+    size_t win_head;
+    size_t win_count;
+    size_t win_capacity;
+    int win_sum;
+    size_t removed;             // key events dropped so far
+} Simplifier;
+
+static inline void simplifier_init(Simplifier* s, const SimplifyConfig* cfg, const char* piano_scale) {
+    memset(s, 0, sizeof(*s));
+    s->cfg = *cfg;
+    memset(s->pos, -1, sizeof(s->pos));
+    for (int i = 0; piano_scale[i] && i < 64; i++) {
+        s->pos[(unsigned char)piano_scale[i]] = (int8_t)i;
+    }
+}
+
+static inline void simplifier_cleanup(Simplifier* s) {
+    free(s->window);
+    s->window = NULL;
+}
+
+static inline void simplifier_window_push(Simplifier* s, double time, int count) {
+    if (count <= 0) return;
+
+    if (s->win_count == s->win_capacity) {
+        size_t new_capacity = s->win_capacity ? s->win_capacity * 2 : 64;
+        SimplifyWindowEntry* grown = malloc(sizeof(SimplifyWindowEntry) * new_capacity);
+        if (!grown) return;
+        for (size_t i = 0; i < s->win_count; i++) {
+            grown[i] = s->window[(s->win_head + i) % s->win_capacity];
+        }
+        free(s->window);
+        s->window = grown;
+        s->win_head = 0;
+        s->win_capacity = new_capacity;
+    }
+
+    s->window[(s->win_head + s->win_count) % s->win_capacity] = (SimplifyWindowEntry){time, count};
+    s->win_count++;
+    s->win_sum += count;
+}
+
+static inline void simplifier_window_expire(Simplifier* s, double time) {
+    while (s->win_count && s->window[s->win_head].time <= time - 1.0) {
+        s->win_sum -= s->window[s->win_head].count;
+        s->win_head = (s->win_head + 1) % s->win_capacity;
+        s->win_count--;
+    }
+}
+
+// Picks which keys of a chord survive: top and bottom voice first, then inner
+// voices top-down, new pitch classes before octave doublings.
+static inline uint64_t simplifier_pick(const Simplifier* s, uint64_t chord, int budget) {
+    if (!chord || budget <= 0) return 0;
+
+    int lo = __builtin_ctzll(chord);
+    int hi = 63 - __builtin_clzll(chord);
+
+    uint64_t keep = 1ULL << hi;
+    uint16_t classes = 1u << (hi % 12);
+    int kept = 1;
+
+    if (lo != hi && kept < budget) {
+        keep |= 1ULL << lo;
+        classes |= 1u << (lo % 12);
+        kept++;
+    }
+
+    for (int pass = 0; pass < 2 && kept < budget; pass++) {
+        for (int p = hi - 1; p > lo && kept < budget; p--) {
+            if (!(chord & (1ULL << p)) || (keep & (1ULL << p))) continue;
+
+            if (s->cfg.max_span > 0 && p > lo + s->cfg.max_span && p < hi - s->cfg.max_span) continue;
+
+            int doubling = (classes >> (p % 12)) & 1;
+            if (pass == 0 && doubling) continue;
+
+            keep |= 1ULL << p;
+            classes |= 1u << (p % 12);
+            kept++;
+        }
+    }
+
+    return keep;
+}
+
+// Trims one event in place. keys is a chord ("qwe"), a release ("~q") or
+// something else (tempo markers) that gets passed through untouched.
+// Returns the number of keys left; 0 means the caller should drop the event.
+static inline size_t simplifier_feed(Simplifier* s, double time, char* keys) {
+    simplifier_window_expire(s, time);
+
+    int release = keys[0] == '~';
+    char* k = release ? keys + 1 : keys;
+
+    uint64_t chord = 0;
+    int total = 0;
+    for (char* c = k; *c; c++) {
+        int p = s->pos[(unsigned char)*c];
+        if (p < 0) return strlen(k);
+        if (!(chord & (1ULL << p))) total++;
+        chord |= 1ULL << p;
+    }
+
+    uint64_t keep;
+    if (release) {
+        keep = chord & s->held;
+        s->held &= ~keep;
+    } else {
+        int budget = total;
+        if (s->cfg.max_chord_keys > 0 && budget > s->cfg.max_chord_keys) {
+            budget = s->cfg.max_chord_keys;
+        }
+        if (s->cfg.max_events_per_sec > 0 && budget > s->cfg.max_events_per_sec - s->win_sum) {
+            budget = s->cfg.max_events_per_sec - s->win_sum;
+        }
+        keep = simplifier_pick(s, chord, budget);
+        s->held |= keep;
+    }
+
+    size_t out = 0;
+    for (char* c = k; *c; c++) {
+        uint64_t bit = 1ULL << s->pos[(unsigned char)*c];
+        if (keep & bit) {
+            k[out++] = *c;
+            keep &= ~bit;
+        }
+    }
+    k[out] = '\0';
+
+    s->removed += total - out;
+    simplifier_window_push(s, time, (int)out);
+
+    return out;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// Live stats play_core keeps in POSIX shared memory (/play_core.<pid>) for
+// play_top to read. One writer, any number of readers, no syscalls on the
+// writer side: the block is guarded by a seqlock that is odd while it changes.
+
+#define TELEMETRY_PREFIX "play_core."
+#define TELEMETRY_MAGIC 0x314d4c5459414c50ULL  // "PLAYTLM1"
+#define TELEMETRY_VERSION 2
+
+typedef struct {
+    uint64_t position;          // next event index
+    uint64_t event_count;       // events in the song, 0 while streaming
+    uint32_t playing;
+    uint32_t held_keys;
+    double elapsed;             // song seconds played
+    double duration;            // song seconds total, 0 while streaming
+    double playback_speed;
+    double lateness;            // seconds the last event fired after its slot
+    double max_lateness;
+    double events_per_sec;      // key presses sent, over the last second
+    uint64_t keys_sent;
+    double flush_latency;       // seconds spent in the last XFlush
+    double max_flush_latency;
+    uint64_t catchup_compressed;  // events fired early to close a small lag
+    uint64_t catchup_merged;      // events folded into a chord to close a big one
+    uint64_t catchup_dropped;     // keys left out of those chords
+    uint64_t song_hash;         // FNV-1a of the first 64KB of song.txt
+    uint64_t song_size;
+    int64_t song_mtime;
+    double updated;             // CLOCK_MONOTONIC of the last publish
+} TelemetryStats;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    int32_t pid;
+    _Atomic uint64_t seq;
+    TelemetryStats stats;
+} TelemetryBlock;
+
+static inline void telemetry_write(TelemetryBlock* block, const TelemetryStats* stats) {
+    uint64_t seq = atomic_load_explicit(&block->seq, memory_order_relaxed);
+    atomic_store_explicit(&block->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&block->stats, stats, sizeof(*stats));
+    atomic_store_explicit(&block->seq, seq + 2, memory_order_release);
+}
+
+// Returns 0 if the writer kept getting in the way; just try again later.
+static inline int telemetry_read(const TelemetryBlock* block, TelemetryStats* out) {
+    for (int tries = 0; tries < 1000; tries++) {
+        uint64_t before = atomic_load_explicit((_Atomic uint64_t*)&block->seq, memory_order_acquire);
+        if (before & 1) continue;
+        
+        memcpy(out, (const void*)&block->stats, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        
+        uint64_t after = atomic_load_explicit((_Atomic uint64_t*)&block->seq, memory_order_relaxed);
+        if (before == after) return 1;
+    }
+    return 0;
+}
+
+#define TELEMETRY_HASH_BYTES (64 * 1024)
+
+static inline uint64_t telemetry_hash(const void* data, size_t size) {
+    const unsigned char* p = data;
+    if (size > TELEMETRY_HASH_BYTES) size = TELEMETRY_HASH_BYTES;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Decodes MIDI files through both the SIMD block kernel and the scalar path
+# and fails on any difference (midi_core --check-decode). Covers the corpus
+# runs plus a generated running-status run long enough to cross many blocks,
+# with velocity-0 note-ons and multi-byte deltas that break blocks off
+# mid-run. Run from the repo root: tests/check_decode.sh
+set -e
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 $CFLAGS -o "$work/midi_core" midi_core.c -lpthread
+
+# Writes a big-endian 32-bit length.
+be32() {
+    printf "\\$(printf %03o $(($1 >> 24 & 255)))\\$(printf %03o $(($1 >> 16 & 255)))"
+    printf "\\$(printf %03o $(($1 >> 8 & 255)))\\$(printf %03o $(($1 & 255)))"
+}
+
+byte() {
+    printf "\\$(printf %03o $1)"
+}
+
+# Running-status Note On with one-byte deltas; every 5th note is velocity 0
+# (a release), every 97th event has a two-byte delta.
+{
+    byte 0; byte 0x90; byte 60; byte 100
+    for i in $(seq 1 3000); do
+        if [ $((i % 97)) -eq 0 ]; then
+            byte 0x81; byte $((i % 128))
+        else
+            byte $((i % 4))
+        fi
+        byte $((36 + i * 7 % 61))
+        if [ $((i % 5)) -eq 0 ]; then byte 0; else byte $((1 + i % 127)); fi
+    done
+    byte 0; byte 0xFF; byte 0x2F; byte 0
+} > "$work/body"
+
+{
+    printf 'MThd'; be32 6; byte 0; byte 0; byte 0; byte 1; byte 1; byte 0xE0
+    printf 'MTrk'; be32 $(wc -c < "$work/body"); cat "$work/body"
+} > "$work/long_run.mid"
+
+status=0
+for midi in fuzz/corpus/fast_run.mid fuzz/corpus/running_status.mid "$work/long_run.mid"; do
+    if ! "$work/midi_core" --check-decode "$midi"; then
+        echo "FAILED: $midi"
+        status=1
+    fi
+done
+exit $status
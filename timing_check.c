@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <math.h>
+#include <ctype.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+// Headless timing check: starts a private Xvfb, focuses a recording window,
+// lets play_core play song.txt into it and compares what arrived against the
+// schedule song.txt asks for.
+
+const char* displayName = ":87";
+const char* playerPath = "./play_core";
+double toleranceMs = 10.0;
+double matchWindowMs = 250.0;
+
+typedef struct {
+    double time;
+    KeyCode keycode;
+    int shifted;
+    size_t event;
+    double received;
+    int matched;
+} ExpectedKey;
+
+typedef struct {
+    double time;
+    KeyCode keycode;
+    int press;
+} ReceivedKey;
+
+ExpectedKey* expected = NULL;
+size_t expected_count = 0;
+size_t expected_capacity = 0;
+size_t expected_shifted = 0;
+double expected_duration = 0;
+
+ReceivedKey* received = NULL;
+size_t received_count = 0;
+size_t received_capacity = 0;
+
+Display* dpy = NULL;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleep_ms(int ms) {
+    usleep(ms * 1000);
+}
+
+// Same mapping play_core uses, so keycodes line up on the shared keymap.
+KeySym letter_keysym(char strLetter) {
+    char name[2] = {strLetter, '\0'};
+    KeySym keysym = XStringToKeysym(name);
+    if (keysym != NoSymbol) return keysym;
+    
+    switch (strLetter) {
+        case '!': return XK_exclam;
+        case '@': return XK_at;
+        case '#': return XK_numbersign;
+        case '$': return XK_dollar;
+        case '%': return XK_percent;
+        case '^': return XK_asciicircum;
+        case '&': return XK_ampersand;
+        case '*': return XK_asterisk;
+        case '(': return XK_parenleft;
+        case ')': return XK_parenright;
+    }
+    
+    if (isdigit((unsigned char)strLetter)) return XK_0 + (strLetter - '0');
+    if (isalpha((unsigned char)strLetter)) return XK_a + (tolower((unsigned char)strLetter) - 'a');
+    return NoSymbol;
+}
+
+int isShifted(char charIn) {
+    return isupper((unsigned char)charIn) || ispunct((unsigned char)charIn);
+}
+
+void add_expected(double time, KeyCode keycode, int shifted, size_t event) {
+    if (expected_count >= expected_capacity) {
+        expected_capacity = expected_capacity ? expected_capacity * 2 : 256;
+        expected = realloc(expected, sizeof(ExpectedKey) * expected_capacity);
+        if (!expected) exit(1);
+    }
+    
+    ExpectedKey* key = &expected[expected_count++];
+    memset(key, 0, sizeof(*key));
+    key->time = time;
+    key->keycode = keycode;
+    key->shifted = shifted;
+    key->event = event;
+    if (shifted) expected_shifted++;
+}
+
+// Works out when play_core --no-simplify should press every key: beats go
+// through the tempo map, each event waits for the gap to the next one, and the
+// last event gets 1.00s, all divided by playback_speed.
+int load_schedule(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return 0;
+    }
+    
+    char* line = NULL;
+    size_t line_capacity = 0;
+    
+    if (getline(&line, &line_capacity, file) < 0 || strncmp(line, "playback_speed=", 15) != 0) {
+        printf("First line should be playback_speed=1.0\n");
+        free(line);
+        fclose(file);
+        return 0;
+    }
+    double playback_speed = atof(line + 15);
+    
+    char** keys = NULL;
+    double* times = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    
+    double seconds_per_beat = 0.5;
+    double last_beat = 0;
+    double seconds = 0;
+    
+    while (getline(&line, &line_capacity, file) >= 0) {
+        line[strcspn(line, "\r\n")] = 0;
+        
+        char* space = strchr(line, ' ');
+        if (!space) continue;
+        
+        *space = 0;
+        double beat = atof(line);
+        if (beat > last_beat) {
+            seconds += (beat - last_beat) * seconds_per_beat;
+            last_beat = beat;
+        }
+        
+        if (strncmp(space + 1, "tempo=", 6) == 0) {
+            double bpm = atof(space + 7);
+            if (bpm > 0) seconds_per_beat = 60.0 / bpm;
+            continue;
+        }
+        
+        if (count >= capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            keys = realloc(keys, sizeof(char*) * capacity);
+            times = realloc(times, sizeof(double) * capacity);
+            if (!keys || !times) exit(1);
+        }
+        keys[count] = strdup(space + 1);
+        times[count++] = seconds;
+    }
+    
+    free(line);
+    fclose(file);
+    
+    double at = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (keys[i][0] != '~') {
+            for (const char* c = keys[i]; *c; c++) {
+                KeyCode keycode = XKeysymToKeycode(dpy, letter_keysym(*c));
+                if (keycode) add_expected(at, keycode, isShifted(*c), i);
+            }
+        }
+        
+        double delay = i + 1 < count ? times[i + 1] - times[i] : 1.00;
+        at += (delay > 0 ? delay : 0) / playback_speed;
+        free(keys[i]);
+    }
+    
+    expected_duration = at;
+    free(keys);
+    free(times);
+    return 1;
+}
+
+pid_t spawn(char* const argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+void stop_child(pid_t pid, int ms) {
+    if (pid <= 0) return;
+    
+    for (int waited = 0; waited < ms; waited += 10) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+void tap_key(KeySym keysym) {
+    KeyCode keycode = XKeysymToKeycode(dpy, keysym);
+    XTestFakeKeyEvent(dpy, keycode, True, 0);
+    XTestFakeKeyEvent(dpy, keycode, False, 0);
+    XFlush(dpy);
+}
+
+Bool is_key_event(Display* d, XEvent* ev, XPointer keycode) {
+    (void)d;
+    return (ev->type == KeyPress || ev->type == KeyRelease) && ev->xkey.keycode == *(KeyCode*)keycode;
+}
+
+// Taps DELETE until play_core owns it. Before its grab is in place the tap
+// lands in our focused window instead, and we just try again.
+int start_player(pid_t player, double* start) {
+    KeyCode deleteKey = XKeysymToKeycode(dpy, XK_Delete);
+    
+    for (int waited = 0; waited < 10000; waited += 20) {
+        if (waitpid(player, NULL, WNOHANG) == player) return 0;
+        
+        *start = now_seconds();
+        tap_key(XK_Delete);
+        XSync(dpy, False);
+        
+        XEvent ev;
+        int missed = 0;
+        while (XCheckIfEvent(dpy, &ev, is_key_event, (XPointer)&deleteKey)) missed = 1;
+        if (!missed) return 1;
+        
+        sleep_ms(20);
+    }
+    return 0;
+}
+
+Window open_recorder() {
+    Window window = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 320, 240, 0, 0, 0);
+    XSelectInput(dpy, window, KeyPressMask | KeyReleaseMask | StructureNotifyMask);
+    XMapRaised(dpy, window);
+    
+    XEvent ev;
+    do {
+        XNextEvent(dpy, &ev);
+    } while (ev.type != MapNotify);
+    
+    XSetInputFocus(dpy, window, RevertToPointerRoot, CurrentTime);
+    XSync(dpy, False);
+    return window;
+}
+
+// Timestamps are taken on receipt with CLOCK_MONOTONIC; server timestamps
+// only have millisecond resolution.
+void record_keys(double start) {
+    size_t presses = 0;
+    size_t wanted = expected_count + expected_shifted;
+    double deadline = start + expected_duration + 3.0;
+    int fd = ConnectionNumber(dpy);
+    
+    while (now_seconds() < deadline) {
+        if (presses >= wanted && now_seconds() > start + expected_duration + 0.5) break;
+        
+        if (!XPending(dpy)) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            struct timeval tv = {0, 10000};
+            select(fd + 1, &fds, NULL, NULL, &tv);
+            continue;
+        }
+        
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        if (ev.type != KeyPress && ev.type != KeyRelease) continue;
+        
+        if (received_count >= received_capacity) {
+            received_capacity = received_capacity ? received_capacity * 2 : 1024;
+            received = realloc(received, sizeof(ReceivedKey) * received_capacity);
+            if (!received) exit(1);
+        }
+        
+        ReceivedKey* key = &received[received_count++];
+        key->time = now_seconds() - start;
+        key->keycode = ev.xkey.keycode;
+        key->press = ev.type == KeyPress;
+        if (key->press) presses++;
+    }
+}
+
+// Matches presses per keycode in order, allowing matchWindowMs either way
+// around the schedule, then prints the report. Returns 1 if the run passes.
+int report() {
+    KeyCode shiftKey = XKeysymToKeycode(dpy, XK_Shift_L);
+    size_t* cursor = calloc(256, sizeof(size_t));
+    size_t** by_key = calloc(256, sizeof(size_t*));
+    size_t by_key_count[256] = {0};
+    
+    for (size_t i = 0; i < expected_count; i++) by_key_count[expected[i].keycode]++;
+    for (int k = 0; k < 256; k++) {
+        if (by_key_count[k]) by_key[k] = malloc(sizeof(size_t) * by_key_count[k]);
+        by_key_count[k] = 0;
+    }
+    for (size_t i = 0; i < expected_count; i++) {
+        KeyCode k = expected[i].keycode;
+        by_key[k][by_key_count[k]++] = i;
+    }
+    
+    double offset = 0;
+    int have_offset = 0;
+    size_t extra = 0;
+    size_t shift_presses = 0;
+    size_t releases = 0;
+    int down[256] = {0};
+    double window = matchWindowMs / 1000.0;
+    
+    for (size_t r = 0; r < received_count; r++) {
+        ReceivedKey* key = &received[r];
+        
+        if (!key->press) {
+            releases++;
+            if (down[key->keycode] > 0) down[key->keycode]--;
+            continue;
+        }
+        down[key->keycode]++;
+        
+        if (key->keycode == shiftKey) {
+            shift_presses++;
+            continue;
+        }
+        
+        if (!have_offset && expected_count) {
+            offset = key->time - expected[0].time;
+            have_offset = 1;
+        }
+        
+        KeyCode k = key->keycode;
+        while (cursor[k] < by_key_count[k] && expected[by_key[k][cursor[k]]].time + offset < key->time - window) {
+            cursor[k]++;
+        }
+        
+        if (cursor[k] < by_key_count[k] && expected[by_key[k][cursor[k]]].time + offset <= key->time + window) {
+            ExpectedKey* match = &expected[by_key[k][cursor[k]++]];
+            match->matched = 1;
+            match->received = key->time;
+        } else {
+            extra++;
+        }
+    }
+    
+    size_t missing = 0;
+    size_t matched = 0;
+    double drift_sum = 0;
+    double drift_sq = 0;
+    double drift_max = 0;
+    double drift_final = 0;
+    
+    for (size_t i = 0; i < expected_count; i++) {
+        if (!expected[i].matched) {
+            missing++;
+            continue;
+        }
+        
+        double drift = (expected[i].received - expected[i].time - offset) * 1000.0;
+        drift_sum += drift;
+        drift_sq += drift * drift;
+        if (fabs(drift) > drift_max) drift_max = fabs(drift);
+        drift_final = drift;
+        matched++;
+    }
+    
+    double chord_sum = 0;
+    double chord_max = 0;
+    size_t chords = 0;
+    
+    for (size_t i = 0; i < expected_count; ) {
+        size_t j = i;
+        double lo = 0, hi = 0;
+        size_t keys = 0;
+        
+        while (j < expected_count && expected[j].event == expected[i].event) {
+            if (expected[j].matched) {
+                if (!keys || expected[j].received < lo) lo = expected[j].received;
+                if (!keys || expected[j].received > hi) hi = expected[j].received;
+                keys++;
+            }
+            j++;
+        }
+        
+        if (keys > 1) {
+            double spread = (hi - lo) * 1000.0;
+            chord_sum += spread;
+            if (spread > chord_max) chord_max = spread;
+            chords++;
+        }
+        i = j;
+    }
+    
+    size_t stuck = 0;
+    for (int k = 0; k < 256; k++) stuck += down[k];
+    
+    double mean = matched ? drift_sum / matched : 0;
+    double jitter = matched ? sqrt(drift_sq / matched - mean * mean) : 0;
+    
+    printf("Timing check: %zu expected key presses over %.2f s\n", expected_count, expected_duration);
+    printf("Received:       %zu presses, %zu releases\n", received_count - releases, releases);
+    printf("Start latency:  %.2f ms\n", offset * 1000.0);
+    printf("Drift:          mean %.3f ms, max %.3f ms, final %.3f ms\n", mean, drift_max, drift_final);
+    printf("Jitter:         %.3f ms (stddev)\n", jitter);
+    printf("Chord spread:   mean %.3f ms, max %.3f ms over %zu chords\n",
+           chords ? chord_sum / chords : 0, chord_max, chords);
+    printf("Missing keys:   %zu\n", missing);
+    printf("Extra keys:     %zu\n", extra);
+    printf("Stuck keys:     %zu\n", stuck);
+    printf("Shift presses:  %zu (expected %zu)\n", shift_presses, expected_shifted);
+    
+    for (int k = 0; k < 256; k++) free(by_key[k]);
+    free(by_key);
+    free(cursor);
+    
+    int pass = missing == 0 && extra == 0 && stuck == 0 &&
+               shift_presses == expected_shifted && drift_max <= toleranceMs;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] [song.txt]\n", name);
+    fprintf(stderr, "  --display :N      display number for the private Xvfb (default :87)\n");
+    fprintf(stderr, "  --player PATH     play_core binary to drive (default ./play_core)\n");
+    fprintf(stderr, "  --tolerance MS    max drift allowed before failing (default 10)\n");
+    fprintf(stderr, "  --window MS       how far off a key can be and still count (default 250)\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* songPath = "song.txt";
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--display") == 0 && i + 1 < argc) {
+            displayName = argv[++i];
+        } else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc) {
+            playerPath = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            toleranceMs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            matchWindowMs = atof(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            songPath = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    // play_core only reads song.txt from its working directory.
+    if (strcmp(songPath, "song.txt") != 0) {
+        const char* slash = strrchr(songPath, '/');
+        if (!slash || strcmp(slash + 1, "song.txt") != 0) {
+            fprintf(stderr, "The song has to be called song.txt\n");
+            return 1;
+        }
+        char* dir = strndup(songPath, slash - songPath);
+        if (chdir(dir[0] ? dir : "/") != 0) {
+            perror("chdir");
+            free(dir);
+            return 1;
+        }
+        free(dir);
+        songPath = "song.txt";
+    }
+    
+    char* xvfbArgs[] = {"Xvfb", (char*)displayName, "-screen", "0", "640x480x24", "-nolisten", "tcp", NULL};
+    pid_t xvfb = spawn(xvfbArgs);
+    if (xvfb < 0) {
+        perror("fork");
+        return 1;
+    }
+    
+    for (int waited = 0; !dpy && waited < 5000; waited += 50) {
+        if (waitpid(xvfb, NULL, WNOHANG) == xvfb) break;
+        sleep_ms(50);
+        dpy = XOpenDisplay(displayName);
+    }
+    if (!dpy) {
+        fprintf(stderr, "Couldn't start Xvfb on %s\n", displayName);
+        stop_child(xvfb, 0);
+        return 1;
+    }
+    setenv("DISPLAY", displayName, 1);
+    
+    int event_base, error_base, major, minor;
+    if (!XTestQueryExtension(dpy, &event_base, &error_base, &major, &minor)) {
+        fprintf(stderr, "Xvfb has no XTest extension\n");
+        XCloseDisplay(dpy);
+        kill(xvfb, SIGTERM);
+        stop_child(xvfb, 2000);
+        return 1;
+    }
+    
+    if (!load_schedule(songPath) || expected_count == 0) {
+        fprintf(stderr, "Nothing to check in %s\n", songPath);
+        XCloseDisplay(dpy);
+        kill(xvfb, SIGTERM);
+        stop_child(xvfb, 2000);
+        return 1;
+    }
+    
+    open_recorder();
+    
+    char* playerArgs[] = {(char*)playerPath, "--no-simplify", "--seed", "1", NULL};
+    pid_t player = spawn(playerArgs);
+    
+    int ok = 0;
+    double start;
+    if (player > 0 && start_player(player, &start)) {
+        record_keys(start);
+        ok = report();
+        tap_key(XK_Escape);
+    } else {
+        fprintf(stderr, "%s never started playing\n", playerPath);
+    }
+    
+    if (player > 0) stop_child(player, 2000);
+    
+    XCloseDisplay(dpy);
+    kill(xvfb, SIGTERM);
+    stop_child(xvfb, 2000);
+    
+    free(expected);
+    free(received);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Trace spans for midi_core and play_core. Build with -DTRACE to get them;
+// without it every TRACE_* macro expands to nothing and trace_export() just
+// says so. Each thread records into its own ring (the oldest spans get
+// overwritten), and trace_export() writes everything still in the rings as
+// Chrome trace JSON, which chrome://tracing and ui.perfetto.dev both open.
+//
+//   TRACE_SCOPE("clean_notes");       // span until the end of the block
+//   TRACE_BEGIN(t); ... TRACE_END(t, "send");
+
+#include <stdio.h>
+
+#ifdef TRACE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SPANS 65536
+#define TRACE_MAX_THREADS 128
+
+typedef struct {
+    const char* name;
+    uint64_t start;    // CLOCK_MONOTONIC ns
+    uint64_t length;
+} TraceSpan;
+
+typedef struct {
+    int tid;
+    _Atomic uint64_t head;
+    TraceSpan spans[TRACE_RING_SPANS];
+} TraceRing;
+
+static TraceRing* traceRings[TRACE_MAX_THREADS];
+static _Atomic int traceRingCount = 0;
+static __thread TraceRing* traceRing = NULL;
+static __thread int traceRingFailed = 0;
+
+static inline uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline TraceRing* trace_thread_ring() {
+    if (traceRing || traceRingFailed) return traceRing;
+
+    int slot = atomic_fetch_add(&traceRingCount, 1);
+    if (slot >= TRACE_MAX_THREADS) {
+        traceRingFailed = 1;
+        return NULL;
+    }
+
+    TraceRing* ring = calloc(1, sizeof(TraceRing));
+    if (!ring) {
+        traceRingFailed = 1;
+        return NULL;
+    }
+    ring->tid = (int)syscall(SYS_gettid);
+
+    __atomic_store_n(&traceRings[slot], ring, __ATOMIC_RELEASE);
+    traceRing = ring;
+    return ring;
+}
+
+static inline void trace_record(const char* name, uint64_t start) {
+    uint64_t end = trace_now();
+    TraceRing* ring = trace_thread_ring();
+    if (!ring) return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->spans[head % TRACE_RING_SPANS] = (TraceSpan){name, start, end - start};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+} TraceScope;
+
+static inline void trace_scope_end(TraceScope* scope) {
+    trace_record(scope->name, scope->start);
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) = {(name), trace_now()}
+#define TRACE_BEGIN(var) uint64_t var = trace_now()
+#define TRACE_END(var, name) trace_record((name), (var))
+
+// Rings keep being written while we export. Once a ring has wrapped only its
+// newest three quarters are read, so a writer would have to lap us to tear one.
+static inline int trace_export(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return 0;
+
+    int pid = (int)getpid();
+    int first = 1;
+    fprintf(file, "{\"traceEvents\":[\n");
+
+    int rings = atomic_load(&traceRingCount);
+    if (rings > TRACE_MAX_THREADS) rings = TRACE_MAX_THREADS;
+
+    for (int r = 0; r < rings; r++) {
+        TraceRing* ring = __atomic_load_n(&traceRings[r], __ATOMIC_ACQUIRE);
+        if (!ring) continue;
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t from = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS * 3 / 4 : 0;
+
+        for (uint64_t i = from; i < head; i++) {
+            TraceSpan span = ring->spans[i % TRACE_RING_SPANS];
+            if (!span.name) continue;
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",\n", span.name, pid, ring->tid,
+                    span.start / 1000.0, span.length / 1000.0);
+            first = 0;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_BEGIN(var) do {} while (0)
+#define TRACE_END(var, name) do {} while (0)
+
+static inline int trace_export(const char* path) {
+    (void)path;
+    fprintf(stderr, "Tracing is compiled out; rebuild with -DTRACE\n");
+    return 0;
+}
+
+#endif
+
+#endif